@@ -0,0 +1,396 @@
+#pragma once
+
+#include <iterator>
+#include <algorithm>
+#include <vector>
+
+#include "threadman.h"
+
+namespace a7az0th {
+
+	namespace execution {
+
+		// Execution policy that makes the algorithm overloads below run on the workers of a ThreadManager.
+		// Analogous to std::execution::par, but the work goes to our own pinned, instrumented pool
+		// instead of whatever backend the standard library picks.
+		// The pool is type-erased, so the algorithms are not instantiated once per pool policy.
+		struct ThreadManagerPolicy {
+			void* pool;               // The pool to run on
+			void (*runFor)(void* pool, MultiThreadedFor& loop, int numIterations, int numThreads);
+			void (*runThreads)(void* pool, MultiThreaded& loop, int numThreads);
+			int numThreads;           // How many threads to use. THREADS_AUTO lets the loop decide
+			size_t grainSize;         // The smallest number of elements handed to a worker at once
+
+			// Returns a copy of the policy with a different grain size
+			ThreadManagerPolicy grain(size_t elements) const {
+				ThreadManagerPolicy res = *this;
+				res.grainSize = elements;
+				return res;
+			}
+
+			template <class Policy>
+			static void runForOn(void* pool, MultiThreadedFor& loop, int numIterations, int numThreads) {
+				loop.run(*static_cast<ThreadManagerT<Policy>*>(pool), numIterations, numThreads);
+			}
+			template <class Policy>
+			static void runThreadsOn(void* pool, MultiThreaded& loop, int numThreads) {
+				loop.run(*static_cast<ThreadManagerT<Policy>*>(pool), numThreads);
+			}
+		};
+
+		// Creates a policy that runs on the given pool
+		// @param threadman The pool to run on
+		// @param numThreads How many threads to use. THREADS_AUTO picks the count from the cost of the work
+		template <class Policy>
+		ThreadManagerPolicy par(ThreadManagerT<Policy>& threadman, int numThreads = THREADS_AUTO) {
+			ThreadManagerPolicy res;
+			res.pool = &threadman;
+			res.runFor = &ThreadManagerPolicy::runForOn<Policy>;
+			res.runThreads = &ThreadManagerPolicy::runThreadsOn<Policy>;
+			res.numThreads = numThreads;
+			res.grainSize = 1;
+			return res;
+		}
+
+	}//namespace execution
+
+	namespace detail {
+
+		// Calls fn(begin, end, chunk) for consecutive chunks of [0, size) from all workers
+		template <class Fn>
+		struct ChunkedFor : MultiThreadedFor {
+			ChunkedFor(Fn& fn, size_t size, size_t chunkSize) : fn(fn), size(size), chunkSize(chunkSize) {}
+			void body(int index, int, int) override {
+				const size_t begin = size_t(index) * chunkSize;
+				fn(begin, std::min(size, begin + chunkSize), index);
+			}
+		private:
+			Fn& fn;
+			size_t size;
+			size_t chunkSize;
+		};
+
+		// Returns the number of chunks to split size elements into. A few per thread, so that uneven chunks balance out.
+		inline int getChunkCount(const execution::ThreadManagerPolicy& policy, size_t size) {
+			const int threads = (policy.numThreads == THREADS_AUTO) ? getProcessorCount() : policy.numThreads;
+			const size_t grain = std::max(size_t(1), policy.grainSize);
+			const size_t maxChunks = (size + grain - 1) / grain;
+			return int(std::min(maxChunks, size_t(std::max(1, threads) * 8)));
+		}
+
+		// Splits [0, size) into numChunks contiguous chunks and runs fn(begin, end, chunk) for each on the pool
+		template <class Fn>
+		void parallelChunks(const execution::ThreadManagerPolicy& policy, size_t size, int numChunks, Fn& fn) {
+			if (size == 0 || numChunks <= 0) {
+				return;
+			}
+			const size_t chunkSize = (size + numChunks - 1) / numChunks;
+			numChunks = int((size + chunkSize - 1) / chunkSize);
+			ChunkedFor<Fn> loop(fn, size, chunkSize);
+			const int threads = (policy.numThreads == THREADS_AUTO) ? THREADS_AUTO : std::min(policy.numThreads, numChunks);
+			policy.runFor(policy.pool, loop, numChunks, threads);
+		}
+
+		// Reduces element(i) for all i in [0, size) with the given operation, starting from init.
+		// Every chunk reduces into its own slot, which are then combined on the calling thread.
+		template <class T, class Reduce, class Element>
+		T reduceIndices(const execution::ThreadManagerPolicy& policy, size_t size, T init, Reduce& reduce, Element& element) {
+			if (size == 0) {
+				return init;
+			}
+			const int numChunks = getChunkCount(policy, size);
+			std::vector<T> partial(numChunks, init);
+			std::vector<char> used(numChunks, 0);
+			auto fn = [&](size_t begin, size_t end, int chunk) {
+				T acc = element(begin);
+				for (size_t i = begin + 1; i < end; i++) {
+					acc = reduce(acc, element(i));
+				}
+				partial[chunk] = acc;
+				used[chunk] = 1;
+			};
+			parallelChunks(policy, size, numChunks, fn);
+
+			T res = init;
+			for (int i = 0; i < numChunks; i++) {
+				if (used[i]) {
+					res = reduce(res, partial[i]);
+				}
+			}
+			return res;
+		}
+
+		// Calls fn(begin, end) for consecutive blocks of a forward iterator range from all workers.
+		// The shared position can only be advanced one element at a time, so claiming a block happens under a lock,
+		// and blocks are bounded: large enough to amortize the lock, small enough for uneven elements to balance out.
+		template <class It, class Fn>
+		struct BlockedFor : MultiThreaded {
+			BlockedFor(Fn& fn, It first, const It* last, size_t count, size_t blockSize)
+				: fn(fn), next(first), last(last), remaining(count), blockSize(blockSize) {}
+			void threadProc(int, int) override {
+				for (;;) {
+					It begin, end;
+					{
+						MutexRAII lock(mutex);
+						if (remaining == 0 || (last && next == *last)) return;
+						begin = next;
+						size_t n = 0;
+						while (n < blockSize && n < remaining && !(last && next == *last)) {
+							++next;
+							++n;
+						}
+						remaining -= n;
+						end = next;
+					}
+					fn(begin, end);
+				}
+			}
+			// Where the walk stopped. Only valid after the run
+			It getEnd(void) const { return next; }
+		private:
+			Fn& fn;
+			Mutex mutex;      // Guards next and remaining
+			It next;          // Start of the next block
+			const It* last;   // NULL if only the count bounds the range
+			size_t remaining; // Elements left to hand out, for ranges given by a count
+			size_t blockSize;
+		};
+
+		// The smallest block BlockedFor hands out when the policy leaves the grain at 1
+		const size_t MIN_BLOCK_SIZE = 16;
+
+		// Walks at most count elements from first, stopping early at *last unless it is NULL, in blocks and runs
+		// fn(begin, end) for each on the pool. Returns the iterator after the last element walked.
+		template <class It, class Fn>
+		It parallelBlocks(const execution::ThreadManagerPolicy& policy, It first, const It* last, size_t count, Fn& fn) {
+			static_assert(std::is_base_of<std::forward_iterator_tag,
+				typename std::iterator_traits<It>::iterator_category>::value, "forward iterators required");
+			const size_t blockSize = (policy.grainSize > 1) ? policy.grainSize : MIN_BLOCK_SIZE;
+			BlockedFor<It, Fn> loop(fn, first, last, count, blockSize);
+			const int threads = (policy.numThreads == THREADS_AUTO) ? getProcessorCount() : policy.numThreads;
+			policy.runThreads(policy.pool, loop, std::max(threads, 1));
+			return loop.getEnd();
+		}
+
+		template <class It, class F>
+		void forEach(const execution::ThreadManagerPolicy& policy, It first, It last, F& f, std::random_access_iterator_tag) {
+			const size_t size = size_t(last - first);
+			auto fn = [&](size_t begin, size_t end, int) {
+				for (It it = first + begin, e = first + end; it != e; ++it) {
+					f(*it);
+				}
+			};
+			parallelChunks(policy, size, getChunkCount(policy, size), fn);
+		}
+
+		template <class It, class F>
+		void forEach(const execution::ThreadManagerPolicy& policy, It first, It last, F& f, std::forward_iterator_tag) {
+			auto fn = [&](It begin, It end) {
+				for (It it = begin; it != end; ++it) {
+					f(*it);
+				}
+			};
+			parallelBlocks(policy, first, &last, size_t(-1), fn);
+		}
+
+		template <class It, class Size, class F>
+		It forEachN(const execution::ThreadManagerPolicy& policy, It first, Size n, F& f, std::random_access_iterator_tag) {
+			forEach(policy, first, first + n, f, std::random_access_iterator_tag());
+			return first + n;
+		}
+
+		template <class It, class Size, class F>
+		It forEachN(const execution::ThreadManagerPolicy& policy, It first, Size n, F& f, std::forward_iterator_tag) {
+			auto fn = [&](It begin, It end) {
+				for (It it = begin; it != end; ++it) {
+					f(*it);
+				}
+			};
+			return parallelBlocks(policy, first, (const It*)NULL, size_t(n), fn);
+		}
+
+		template <class It>
+		void requireRandomAccess(void) {
+			static_assert(std::is_base_of<std::random_access_iterator_tag,
+				typename std::iterator_traits<It>::iterator_category>::value, "random access iterators required");
+		}
+
+	}//namespace detail
+
+	// Parallel std::for_each. Calls f for every element in [first, last).
+	// Random access ranges are split into chunks by index. Other ranges, e.g. of a std::list or std::map,
+	// are walked in blocks of the grain size of the policy, or of MIN_BLOCK_SIZE elements if it is 1.
+	template <class It, class F>
+	void for_each(const execution::ThreadManagerPolicy& policy, It first, It last, F f) {
+		detail::forEach(policy, first, last, f, typename std::iterator_traits<It>::iterator_category());
+	}
+
+	// Calls f for every element in [first, last) in parallel and emit for each of the results, in the order of the elements.
+	// Every chunk buffers only its own results and emits them as soon as the chunk before it is done emitting,
+	// so emitting overlaps the computation of the later chunks. emit is never called concurrently.
+	template <class It, class F, class Emit>
+	void for_each_ordered(const execution::ThreadManagerPolicy& policy, It first, It last, F f, Emit emit) {
+		detail::requireRandomAccess<It>();
+		typedef typename std::decay<decltype(f(*first))>::type Result;
+		const size_t size = size_t(last - first);
+		OrderedSection section;
+		auto fn = [&](size_t begin, size_t end, int chunk) {
+			std::vector<Result> results;
+			results.reserve(end - begin);
+			for (It it = first + begin, e = first + end; it != e; ++it) {
+				results.push_back(f(*it));
+			}
+			section.run(chunk, [&] {
+				for (size_t i = 0; i < results.size(); i++) {
+					emit(results[i]);
+				}
+			});
+		};
+		detail::parallelChunks(policy, size, detail::getChunkCount(policy, size), fn);
+	}
+
+	// Parallel std::for_each_n. Returns the iterator after the last element. Takes forward iterators like for_each
+	template <class It, class Size, class F>
+	It for_each_n(const execution::ThreadManagerPolicy& policy, It first, Size n, F f) {
+		return detail::forEachN(policy, first, n, f, typename std::iterator_traits<It>::iterator_category());
+	}
+
+	// Parallel std::transform
+	template <class It, class OutIt, class UnaryOp>
+	OutIt transform(const execution::ThreadManagerPolicy& policy, It first, It last, OutIt out, UnaryOp op) {
+		detail::requireRandomAccess<It>();
+		detail::requireRandomAccess<OutIt>();
+		const size_t size = size_t(last - first);
+		auto fn = [&](size_t begin, size_t end, int) {
+			std::transform(first + begin, first + end, out + begin, op);
+		};
+		detail::parallelChunks(policy, size, detail::getChunkCount(policy, size), fn);
+		return out + size;
+	}
+
+	// Parallel std::transform over two input ranges
+	template <class It1, class It2, class OutIt, class BinaryOp>
+	OutIt transform(const execution::ThreadManagerPolicy& policy, It1 first1, It1 last1, It2 first2, OutIt out, BinaryOp op) {
+		detail::requireRandomAccess<It1>();
+		detail::requireRandomAccess<It2>();
+		detail::requireRandomAccess<OutIt>();
+		const size_t size = size_t(last1 - first1);
+		auto fn = [&](size_t begin, size_t end, int) {
+			std::transform(first1 + begin, first1 + end, first2 + begin, out + begin, op);
+		};
+		detail::parallelChunks(policy, size, detail::getChunkCount(policy, size), fn);
+		return out + size;
+	}
+
+	// Parallel std::fill
+	template <class It, class T>
+	void fill(const execution::ThreadManagerPolicy& policy, It first, It last, const T& value) {
+		detail::requireRandomAccess<It>();
+		const size_t size = size_t(last - first);
+		auto fn = [&](size_t begin, size_t end, int) {
+			std::fill(first + begin, first + end, value);
+		};
+		detail::parallelChunks(policy, size, detail::getChunkCount(policy, size), fn);
+	}
+
+	// Parallel std::copy
+	template <class It, class OutIt>
+	OutIt copy(const execution::ThreadManagerPolicy& policy, It first, It last, OutIt out) {
+		detail::requireRandomAccess<It>();
+		detail::requireRandomAccess<OutIt>();
+		const size_t size = size_t(last - first);
+		auto fn = [&](size_t begin, size_t end, int) {
+			std::copy(first + begin, first + end, out + begin);
+		};
+		detail::parallelChunks(policy, size, detail::getChunkCount(policy, size), fn);
+		return out + size;
+	}
+
+	// Parallel std::transform_reduce. Like std::reduce the order in which elements are combined is unspecified,
+	// so reduce must be associative and commutative.
+	template <class It, class T, class BinaryReduce, class UnaryTransform>
+	T transform_reduce(const execution::ThreadManagerPolicy& policy, It first, It last, T init, BinaryReduce reduce, UnaryTransform transform) {
+		detail::requireRandomAccess<It>();
+		auto element = [&](size_t i) { return transform(*(first + i)); };
+		return detail::reduceIndices(policy, size_t(last - first), init, reduce, element);
+	}
+
+	// Parallel std::transform_reduce over two ranges
+	template <class It1, class It2, class T, class BinaryReduce, class BinaryTransform>
+	T transform_reduce(const execution::ThreadManagerPolicy& policy, It1 first1, It1 last1, It2 first2, T init,
+		BinaryReduce reduce, BinaryTransform transform) {
+		detail::requireRandomAccess<It1>();
+		detail::requireRandomAccess<It2>();
+		auto element = [&](size_t i) { return transform(*(first1 + i), *(first2 + i)); };
+		return detail::reduceIndices(policy, size_t(last1 - first1), init, reduce, element);
+	}
+
+	// Parallel inner product
+	template <class It1, class It2, class T>
+	T transform_reduce(const execution::ThreadManagerPolicy& policy, It1 first1, It1 last1, It2 first2, T init) {
+		return a7az0th::transform_reduce(policy, first1, last1, first2, init, std::plus<T>(), std::multiplies<T>());
+	}
+
+	// Parallel std::reduce
+	template <class It, class T, class BinaryOp>
+	T reduce(const execution::ThreadManagerPolicy& policy, It first, It last, T init, BinaryOp op) {
+		typedef typename std::iterator_traits<It>::value_type Value;
+		return a7az0th::transform_reduce(policy, first, last, init, op, [](const Value& v) -> const Value& { return v; });
+	}
+
+	template <class It, class T>
+	T reduce(const execution::ThreadManagerPolicy& policy, It first, It last, T init) {
+		return a7az0th::reduce(policy, first, last, init, std::plus<T>());
+	}
+
+	// Parallel std::count_if
+	template <class It, class Pred>
+	typename std::iterator_traits<It>::difference_type count_if(const execution::ThreadManagerPolicy& policy, It first, It last, Pred pred) {
+		typedef typename std::iterator_traits<It>::difference_type Diff;
+		typedef typename std::iterator_traits<It>::value_type Value;
+		return a7az0th::transform_reduce(policy, first, last, Diff(0), std::plus<Diff>(),
+			[&pred](const Value& v) -> Diff { return pred(v) ? 1 : 0; });
+	}
+
+	// Parallel std::sort. Chunks are sorted in parallel and then merged pairwise, again in parallel.
+	template <class It, class Compare>
+	void sort(const execution::ThreadManagerPolicy& policy, It first, It last, Compare comp) {
+		detail::requireRandomAccess<It>();
+		const size_t size = size_t(last - first);
+		const size_t grain = std::max(policy.grainSize, size_t(2048));
+		int numChunks = detail::getChunkCount(policy.grain(grain), size);
+		if (numChunks <= 1) {
+			std::sort(first, last, comp);
+			return;
+		}
+		const size_t chunkSize = (size + numChunks - 1) / numChunks;
+		numChunks = int((size + chunkSize - 1) / chunkSize);
+
+		auto sortChunk = [&](size_t begin, size_t end, int) {
+			std::sort(first + begin, first + end, comp);
+		};
+		detail::parallelChunks(policy, size, numChunks, sortChunk);
+
+		// Each round merges neighbouring runs of width elements into runs of 2 * width
+		for (size_t width = chunkSize; width < size; width *= 2) {
+			const size_t numMerges = (size + 2 * width - 1) / (2 * width);
+			auto merge = [&](size_t begin, size_t end, int) {
+				for (size_t m = begin; m < end; m++) {
+					const size_t lo = m * 2 * width;
+					const size_t mid = std::min(size, lo + width);
+					const size_t hi = std::min(size, lo + 2 * width);
+					if (mid < hi) {
+						std::inplace_merge(first + lo, first + mid, first + hi, comp);
+					}
+				}
+			};
+			detail::parallelChunks(policy, numMerges, int(numMerges), merge);
+		}
+	}
+
+	template <class It>
+	void sort(const execution::ThreadManagerPolicy& policy, It first, It last) {
+		a7az0th::sort(policy, first, last, std::less<typename std::iterator_traits<It>::value_type>());
+	}
+
+}//namespace a7az0th
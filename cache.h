@@ -0,0 +1,286 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "threadman.h"
+
+namespace a7az0th {
+
+	// Counters of a ConcurrentCache, summed over its shards
+	struct CacheStats {
+		int64 hits;      // Lookups that found a computed value
+		int64 misses;    // Lookups that had to compute the value
+		int64 waits;     // Lookups that found the value being computed by another thread and waited for it
+		int64 evictions; // Values dropped to stay within the budget
+		size_t bytes;    // Size of the values currently cached
+		size_t entries;  // Number of values currently cached, including the ones being computed
+	};
+
+	// A thread-safe memoization cache for expensive values shared between workers.
+	// Keys are spread over shards, each with its own lock and its own share of the byte budget, so workers
+	// looking up different keys rarely contend. Eviction is CLOCK: a hit only sets a bit, and the eviction hand
+	// drops the first value whose bit is clear, clearing bits as it passes - an approximation of LRU that
+	// keeps hits cheap.
+	// Computation is single-flight: if several threads miss on the same key at once, one computes the value
+	// and the others wait for it, or run queued pool tasks in the meantime, see getOrCompute.
+	// Values are handed out as shared pointers, so an evicted value stays valid for whoever still holds it.
+	template <class Key, class Value, class Hash = std::hash<Key>>
+	class ConcurrentCache {
+	public:
+		typedef std::shared_ptr<const Value> ValuePtr;
+		// Returns how many bytes a value counts against the budget
+		typedef std::function<size_t(const Key&, const Value&)> Sizer;
+
+		// @param budgetBytes How many bytes of values to keep, split evenly among the shards
+		// @param numShards How many independently locked parts the cache has. Should be well above the number of workers
+		// @param sizer Returns the size of a value. Empty to count sizeof(Key) + sizeof(Value) for every value
+		explicit ConcurrentCache(size_t budgetBytes, int numShards = 64, Sizer sizer = Sizer())
+			: sizer(sizer), shards(numShards > 0 ? numShards : 1) {
+			for (size_t i = 0; i < shards.size(); i++) {
+				shards[i].reset(new Shard(budgetBytes / shards.size()));
+			}
+		}
+
+		// Returns the cached value of key, calling compute() to produce it on a miss.
+		// If another thread is computing the same key, waits for its result instead of computing it again.
+		// compute is called without any lock held and may use the cache itself, but not for the same key.
+		// If compute throws, the exception propagates and the key is left uncached - threads waiting for it retry.
+		template <class F>
+		ValuePtr getOrCompute(const Key& key, F&& compute) {
+			return lookup(key, compute, NoHelp());
+		}
+
+		// Same as above, but while waiting for another thread to compute the value the caller runs queued tasks
+		// of the pool, instead of blocking a worker
+		template <class F, class Policy>
+		ValuePtr getOrCompute(const Key& key, F&& compute, ThreadManagerT<Policy>& threadman) {
+			return lookup(key, compute, PoolHelp<Policy>(threadman));
+		}
+
+		// Returns the cached value of key, or NULL if it is not cached or still being computed. Counts as a hit
+		ValuePtr find(const Key& key) {
+			Shard& s = getShard(key);
+			MutexRAII lock(s.mutex);
+			typename Index::iterator it = s.index.find(key);
+			if (it == s.index.end() || s.slots[it->second].computing) return ValuePtr();
+			Entry& e = s.slots[it->second];
+			e.referenced = true;
+			s.hits++;
+			return e.value;
+		}
+
+		// Drops the value of key. A value that is being computed is not dropped
+		void erase(const Key& key) {
+			Shard& s = getShard(key);
+			MutexRAII lock(s.mutex);
+			typename Index::iterator it = s.index.find(key);
+			if (it != s.index.end() && !s.slots[it->second].computing) {
+				remove(s, it->second);
+			}
+		}
+
+		// Drops all values, except the ones being computed
+		void clear(void) {
+			for (size_t i = 0; i < shards.size(); i++) {
+				Shard& s = *shards[i];
+				MutexRAII lock(s.mutex);
+				for (size_t slot = 0; slot < s.slots.size(); slot++) {
+					if (s.slots[slot].key && !s.slots[slot].computing) {
+						remove(s, slot);
+					}
+				}
+			}
+		}
+
+		CacheStats getStats(void) {
+			CacheStats res = { 0, 0, 0, 0, 0, 0 };
+			for (size_t i = 0; i < shards.size(); i++) {
+				Shard& s = *shards[i];
+				MutexRAII lock(s.mutex);
+				res.hits += s.hits;
+				res.misses += s.misses;
+				res.waits += s.waits;
+				res.evictions += s.evictions;
+				res.bytes += s.bytes;
+				res.entries += s.index.size();
+			}
+			return res;
+		}
+
+	private:
+		typedef std::unordered_map<Key, size_t, Hash> Index; // Slot of every key
+
+		struct Entry {
+			const Key* key;     // The key in the index, whose nodes do not move. NULL if the slot is free
+			ValuePtr value;     // NULL while computing
+			size_t bytes;       // What the value counts against the budget
+			bool referenced;    // Set on every hit, cleared by the eviction hand
+			bool computing;     // A thread is computing the value. Such entries are never evicted
+		};
+
+		struct Shard {
+			Mutex mutex;
+			std::condition_variable_any ready; // Signalled when a value finished computing
+			Index index;
+			std::vector<Entry> slots;          // The clock
+			std::vector<size_t> freeSlots;
+			size_t hand;                       // Next slot the eviction looks at
+			size_t bytes;                      // Total size of the values
+			size_t budget;
+			int64 hits, misses, waits, evictions;
+
+			explicit Shard(size_t budget) : hand(0), bytes(0), budget(budget), hits(0), misses(0), waits(0), evictions(0) {
+				mutex.setName("ConcurrentCache");
+			}
+		};
+
+		// What waiting for another thread's computation does
+		struct NoHelp {
+			static const bool HELPS = false;
+			bool operator()(void) { return false; }
+		};
+		template <class Policy>
+		struct PoolHelp {
+			static const bool HELPS = true;
+			ThreadManagerT<Policy>& threadman;
+			explicit PoolHelp(ThreadManagerT<Policy>& threadman) : threadman(threadman) {}
+			bool operator()(void) { return threadman.runPendingTask(); }
+		};
+
+		Hash hash;
+		Sizer sizer;
+		std::vector<std::unique_ptr<Shard>> shards;
+
+		Shard& getShard(const Key& key) {
+			// The index uses the low bits of the hash, so mix before taking the shard from the high bits
+			const unsigned long long h = (unsigned long long)hash(key) * 0x9E3779B97F4A7C15ull;
+			return *shards[(h >> 32) % shards.size()];
+		}
+
+		template <class F, class Help>
+		ValuePtr lookup(const Key& key, F& compute, Help help) {
+			Shard& s = getShard(key);
+			MutexLock lock(s.mutex);
+			bool waited = false;
+			typename Index::iterator it;
+			while ((it = s.index.find(key)) != s.index.end()) {
+				Entry& e = s.slots[it->second];
+				if (!e.computing) {
+					e.referenced = true;
+					s.hits++;
+					return e.value;
+				}
+				if (!waited) {
+					s.waits++;
+					waited = true;
+				}
+				if (Help::HELPS) {
+					lock.unlock();
+					const bool helped = help();
+					lock.lock();
+					// Nothing to help with. Sleep briefly, new tasks may be queued meanwhile
+					if (!helped) s.ready.wait_for(lock, std::chrono::milliseconds(1));
+				} else {
+					s.ready.wait(lock);
+				}
+			}
+
+			// Miss. Claim the key, so that others wait for us, and compute the value without holding the lock
+			s.misses++;
+			size_t slot;
+			if (!s.freeSlots.empty()) {
+				slot = s.freeSlots.back();
+				s.freeSlots.pop_back();
+			} else {
+				slot = s.slots.size();
+				s.slots.push_back(Entry());
+			}
+			it = s.index.insert(std::make_pair(key, slot)).first;
+			Entry& claimed = s.slots[slot];
+			claimed.key = &it->first;
+			claimed.value.reset();
+			claimed.bytes = 0;
+			claimed.referenced = false;
+			claimed.computing = true;
+			lock.unlock();
+
+			ClaimGuard guard(*this, s, slot);
+			ValuePtr value = std::make_shared<const Value>(compute());
+			const size_t bytes = sizer ? sizer(key, *value) : sizeof(Key) + sizeof(Value);
+
+			lock.lock();
+			guard.slot = NO_SLOT;
+			// The slots may have been reallocated while computing
+			Entry& e = s.slots[slot];
+			e.value = value;
+			e.bytes = bytes;
+			e.computing = false;
+			s.bytes += bytes;
+			// A value bigger than the whole budget is handed out, but goes with the next eviction
+			if (bytes <= s.budget) {
+				evict(s, slot);
+			}
+			s.ready.notify_all();
+			return value;
+		}
+
+		static const size_t NO_SLOT = size_t(-1);
+
+		// Gives up the claim on a key if computing its value throws, so that the next lookup computes it again
+		// instead of waiting forever
+		struct ClaimGuard {
+			ConcurrentCache& cache;
+			Shard& s;
+			size_t slot; // NO_SLOT once the value is stored
+			ClaimGuard(ConcurrentCache& cache, Shard& s, size_t slot) : cache(cache), s(s), slot(slot) {}
+			~ClaimGuard() {
+				if (slot == NO_SLOT) return;
+				MutexRAII lock(s.mutex);
+				s.slots[slot].computing = false;
+				cache.remove(s, slot);
+				s.ready.notify_all();
+			}
+		};
+
+		// Advances the clock hand until the shard fits its budget. Never evicts the slot keep
+		void evict(Shard& s, size_t keep) {
+			const size_t limit = 2 * s.slots.size(); // Every referenced bit is cleared in the first round
+			for (size_t scanned = 0; s.bytes > s.budget && scanned < limit; scanned++) {
+				const size_t slot = s.hand;
+				s.hand = (s.hand + 1) % s.slots.size();
+				Entry& e = s.slots[slot];
+				if (!e.key || e.computing || slot == keep) continue;
+				if (e.referenced) {
+					e.referenced = false;
+					continue;
+				}
+				remove(s, slot);
+				s.evictions++;
+			}
+		}
+
+		void remove(Shard& s, size_t slot) {
+			Entry& e = s.slots[slot];
+			s.bytes -= e.bytes;
+			// e.key points into the node being erased, so look the node up first. Iterators do not survive a
+			// rehash, so they cannot be kept in the entry instead
+			s.index.erase(s.index.find(*e.key));
+			e.key = NULL;
+			e.value.reset();
+			e.bytes = 0;
+			s.freeSlots.push_back(slot);
+		}
+
+		ConcurrentCache(const ConcurrentCache&) = delete;
+		ConcurrentCache& operator=(const ConcurrentCache&) = delete;
+	};
+
+}//namespace a7az0th
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <future>
+#include <algorithm>
+#include <random>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "threadman.h"
+#include "algorithms.h"
+#include "timer.h"
+
+using namespace a7az0th;
+
+// Runs the same kernels on ThreadManager, the OpenMP runtime of the compiler and std::async,
+// and prints the latency and throughput of each side by side.
+// OpenMP columns are only present if the benchmark was built with OpenMP enabled.
+//
+// Usage: compare_bench [numThreads] [repetitions]
+
+static int numThreads = 1;
+static int repetitions = 20;
+
+// The result of a kernel for a single backend
+struct Result {
+	double latencyUs;  // Median time of a repetition, in microseconds
+	double throughput; // Items per second for the median repetition. 0 if not applicable
+};
+
+// Runs fn the configured number of times and returns the median
+template <class Fn>
+static Result measure(Fn fn, double items) {
+	std::vector<int64> times;
+	fn(); // Warm up, so pool start up is not measured
+	for (int i = 0; i < repetitions; i++) {
+		Timer timer;
+		fn();
+		timer.stop();
+		times.push_back(timer.elapsed(Timer::Nanoseconds));
+	}
+	std::sort(times.begin(), times.end());
+	const double median = double(times[times.size() / 2]);
+	Result res;
+	res.latencyUs = median / 1000.0;
+	res.throughput = (items > 0) ? items / (median * 1e-9) : 0;
+	return res;
+}
+
+static void printHeader(void) {
+	printf("%-22s %27s", "kernel", "threadman");
+#ifdef _OPENMP
+	printf(" %27s", "openmp");
+#endif
+	printf(" %27s\n", "std::async");
+}
+
+static void printResult(const Result& r) {
+	if (r.throughput > 0) {
+		printf(" %12.1f us %7.1f M/s", r.latencyUs, r.throughput * 1e-6);
+	} else {
+		printf(" %12.1f us %11s", r.latencyUs, "");
+	}
+}
+
+static void printRow(const char* name, const Result& tm, const Result& omp, const Result& async) {
+	printf("%-22s", name);
+	printResult(tm);
+#ifdef _OPENMP
+	printResult(omp);
+#else
+	(void)omp;
+#endif
+	printResult(async);
+	printf("\n");
+}
+
+// Runs fn(begin, end) over numThreads contiguous parts of [0, count) with one std::async task per part
+template <class Fn>
+static void asyncChunks(int count, int parts, Fn& fn) {
+	std::vector<std::future<void>> futures;
+	for (int t = 1; t < parts; t++) {
+		const int begin = int((long long)count * t / parts);
+		const int end = int((long long)count * (t + 1) / parts);
+		futures.push_back(std::async(std::launch::async, [&fn, begin, end]() { fn(begin, end); }));
+	}
+	fn(0, int((long long)count / parts));
+	for (size_t i = 0; i < futures.size(); i++) {
+		futures[i].get();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+// Cost of iteration i of the imbalanced loop. Grows linearly, so the last iterations are the most expensive.
+static double imbalancedWork(int i) {
+	double x = 0;
+	for (int k = 0; k < i / 64; k++) {
+		x += sqrt(double(k + i));
+	}
+	return x;
+}
+
+struct EmptyRegion : MultiThreaded {
+	void threadProc(int, int) override {}
+};
+
+struct FineLoop : MultiThreadedFor {
+	float* data;
+	void body(int index, int, int) override { data[index] = data[index] * 1.0001f + 1.0f; }
+};
+
+struct ImbalancedLoop : MultiThreadedFor {
+	double* out;
+	void body(int index, int, int) override { out[index] = imbalancedWork(index); }
+};
+
+struct SumRegion : MultiThreaded {
+	const float* data;
+	int count;
+	double partial[MAX_CPU_COUNT];
+	void threadProc(int index, int numThreads) override {
+		int begin, end;
+		getRange(index, numThreads, count, begin, end);
+		double sum = 0;
+		for (int i = begin; i < end; i++) sum += data[i];
+		partial[index] = sum;
+	}
+};
+
+static long long fibSerial(int n) {
+	return (n < 2) ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+// Splits in two with a nested run until the cutoff, then continues serially
+struct FibRegion : MultiThreaded {
+	ThreadManager* threadman;
+	int n;
+	int depth;
+	long long result[2];
+	void threadProc(int index, int) override {
+		const int m = n - 1 - index;
+		if (depth <= 0 || m < 20) {
+			result[index] = fibSerial(m);
+			return;
+		}
+		FibRegion sub;
+		sub.threadman = threadman;
+		sub.n = m;
+		sub.depth = depth - 1;
+		sub.run(*threadman, 2);
+		result[index] = sub.result[0] + sub.result[1];
+	}
+};
+
+static long long fibAsync(int n, int depth) {
+	if (depth <= 0 || n < 20) return fibSerial(n);
+	std::future<long long> a = std::async(std::launch::async, fibAsync, n - 1, depth - 1);
+	const long long b = fibAsync(n - 2, depth - 1);
+	return a.get() + b;
+}
+
+#ifdef _OPENMP
+static long long fibOmp(int n, int depth) {
+	if (depth <= 0 || n < 20) return fibSerial(n);
+	long long a = 0, b = 0;
+#pragma omp task shared(a)
+	a = fibOmp(n - 1, depth - 1);
+	b = fibOmp(n - 2, depth - 1);
+#pragma omp taskwait
+	return a + b;
+}
+#endif
+
+static int* partition(int* first, int* last) {
+	const int pivot = first[(last - first) / 2];
+	int* mid1 = std::partition(first, last, [pivot](int x) { return x < pivot; });
+	return std::partition(mid1, last, [pivot](int x) { return !(pivot < x); });
+}
+
+struct QuickSortRegion : MultiThreaded {
+	ThreadManager* threadman;
+	int* range[2][2];
+	int depth;
+	void threadProc(int index, int) override { sort(*threadman, range[index][0], range[index][1], depth); }
+
+	static void sort(ThreadManager& threadman, int* first, int* last, int depth) {
+		if (depth <= 0 || last - first < 10000) {
+			std::sort(first, last);
+			return;
+		}
+		int* mid = partition(first, last);
+		QuickSortRegion sub;
+		sub.threadman = &threadman;
+		sub.range[0][0] = first;
+		sub.range[0][1] = mid;
+		sub.range[1][0] = mid;
+		sub.range[1][1] = last;
+		sub.depth = depth - 1;
+		sub.run(threadman, 2);
+	}
+};
+
+static void quickSortAsync(int* first, int* last, int depth) {
+	if (depth <= 0 || last - first < 10000) {
+		std::sort(first, last);
+		return;
+	}
+	int* mid = partition(first, last);
+	std::future<void> a = std::async(std::launch::async, quickSortAsync, first, mid, depth - 1);
+	quickSortAsync(mid, last, depth - 1);
+	a.get();
+}
+
+#ifdef _OPENMP
+static void quickSortOmp(int* first, int* last, int depth) {
+	if (depth <= 0 || last - first < 10000) {
+		std::sort(first, last);
+		return;
+	}
+	int* mid = partition(first, last);
+#pragma omp task
+	quickSortOmp(first, mid, depth - 1);
+	quickSortOmp(mid, last, depth - 1);
+#pragma omp taskwait
+}
+#endif
+
+int main(int argc, char* argv[]) {
+	numThreads = (argc > 1) ? atoi(argv[1]) : getProcessorCount();
+	repetitions = (argc > 2) ? atoi(argv[2]) : 20;
+	numThreads = std::max(1, std::min(numThreads, MAX_CPU_COUNT));
+
+	ThreadManager threadman;
+	threadman.warmup(numThreads);
+#ifdef _OPENMP
+	omp_set_num_threads(numThreads);
+#endif
+	// Recursion depth that yields a few tasks per thread
+	int depth = 2;
+	while ((1 << depth) < numThreads * 2) depth++;
+
+	printf("%d threads, median of %d repetitions\n", numThreads, repetitions);
+	printHeader();
+
+	const Result none = { 0, 0 };
+
+	// Empty parallel region - pure dispatch and join cost
+	{
+		EmptyRegion region;
+		Result tm = measure([&]() { region.run(threadman, numThreads); }, 0);
+		Result omp = none;
+#ifdef _OPENMP
+		omp = measure([&]() {
+#pragma omp parallel
+			{}
+		}, 0);
+#endif
+		Result async = measure([&]() {
+			auto fn = [](int, int) {};
+			asyncChunks(numThreads, numThreads, fn);
+		}, 0);
+		printRow("empty region", tm, omp, async);
+	}
+
+	// Fine grained loop - tiny iterations, dominated by scheduling overhead
+	{
+		const int count = 1 << 20;
+		std::vector<float> data(count, 1.0f);
+		FineLoop loop;
+		loop.data = &data[0];
+		Result tm = measure([&]() { loop.run(threadman, count, numThreads); }, count);
+		Result omp = none;
+#ifdef _OPENMP
+		omp = measure([&]() {
+			float* d = &data[0];
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int i = 0; i < count; i++) d[i] = d[i] * 1.0001f + 1.0f;
+		}, count);
+#endif
+		Result async = measure([&]() {
+			float* d = &data[0];
+			auto fn = [d](int begin, int end) { for (int i = begin; i < end; i++) d[i] = d[i] * 1.0001f + 1.0f; };
+			asyncChunks(count, numThreads, fn);
+		}, count);
+		printRow("fine-grained loop", tm, omp, async);
+
+		// The same loop through the algorithm adapter, which hands out chunks instead of single iterations
+		Result tmChunked = measure([&]() {
+			a7az0th::for_each(execution::par(threadman, numThreads), data.begin(), data.end(), [](float& x) { x = x * 1.0001f + 1.0f; });
+		}, count);
+		Result ompStatic = none;
+#ifdef _OPENMP
+		ompStatic = measure([&]() {
+			float* d = &data[0];
+#pragma omp parallel for schedule(static)
+			for (int i = 0; i < count; i++) d[i] = d[i] * 1.0001f + 1.0f;
+		}, count);
+#endif
+		printRow("fine-grained chunked", tmChunked, ompStatic, async);
+	}
+
+	// Imbalanced loop - the cost of an iteration grows with its index
+	{
+		const int count = 1 << 14;
+		std::vector<double> out(count);
+		ImbalancedLoop loop;
+		loop.out = &out[0];
+		Result tm = measure([&]() { loop.run(threadman, count, numThreads); }, count);
+		Result omp = none;
+#ifdef _OPENMP
+		omp = measure([&]() {
+			double* o = &out[0];
+#pragma omp parallel for schedule(dynamic, 16)
+			for (int i = 0; i < count; i++) o[i] = imbalancedWork(i);
+		}, count);
+#endif
+		Result async = measure([&]() {
+			double* o = &out[0];
+			auto fn = [o](int begin, int end) { for (int i = begin; i < end; i++) o[i] = imbalancedWork(i); };
+			asyncChunks(count, numThreads, fn);
+		}, count);
+		printRow("imbalanced loop", tm, omp, async);
+	}
+
+	// Reduction - sum of an array
+	{
+		const int count = 1 << 22;
+		std::vector<float> data(count, 0.5f);
+		volatile double sink = 0;
+		SumRegion region;
+		region.data = &data[0];
+		region.count = count;
+		Result tm = measure([&]() {
+			region.run(threadman, numThreads);
+			double sum = 0;
+			for (int i = 0; i < numThreads; i++) sum += region.partial[i];
+			sink = sum;
+		}, count);
+		Result omp = none;
+#ifdef _OPENMP
+		omp = measure([&]() {
+			const float* d = &data[0];
+			double sum = 0;
+#pragma omp parallel for reduction(+:sum)
+			for (int i = 0; i < count; i++) sum += d[i];
+			sink = sum;
+		}, count);
+#endif
+		Result async = measure([&]() {
+			std::vector<double> partial(numThreads, 0);
+			const float* d = &data[0];
+			std::atomic<int> part(0);
+			auto fn = [&](int begin, int end) {
+				double sum = 0;
+				for (int i = begin; i < end; i++) sum += d[i];
+				partial[part++] = sum;
+			};
+			asyncChunks(count, numThreads, fn);
+			double sum = 0;
+			for (int i = 0; i < numThreads; i++) sum += partial[i];
+			sink = sum;
+		}, count);
+		printRow("reduction", tm, omp, async);
+		(void)sink;
+	}
+
+	// Recursive fibonacci - nested fork/join
+	{
+		const int n = 32;
+		volatile long long sink = 0;
+		Result tm = measure([&]() {
+			FibRegion region;
+			region.threadman = &threadman;
+			region.n = n + 1;
+			region.depth = depth;
+			region.run(threadman, 1);
+			sink = region.result[0];
+		}, 0);
+		Result omp = none;
+#ifdef _OPENMP
+		omp = measure([&]() {
+			long long res = 0;
+#pragma omp parallel
+#pragma omp single
+			res = fibOmp(n, depth);
+			sink = res;
+		}, 0);
+#endif
+		Result async = measure([&]() { sink = fibAsync(n, depth); }, 0);
+		printRow("recursive fib(32)", tm, omp, async);
+		(void)sink;
+	}
+
+	// Recursive quicksort - nested fork/join over uneven partitions
+	{
+		const int count = 1 << 21;
+		std::vector<int> input(count);
+		std::mt19937 rng(12345);
+		for (int i = 0; i < count; i++) input[i] = int(rng());
+		std::vector<int> data;
+		Result tm = measure([&]() {
+			data = input;
+			QuickSortRegion::sort(threadman, &data[0], &data[0] + count, depth);
+		}, count);
+		Result omp = none;
+#ifdef _OPENMP
+		omp = measure([&]() {
+			data = input;
+#pragma omp parallel
+#pragma omp single
+			quickSortOmp(&data[0], &data[0] + count, depth);
+		}, count);
+#endif
+		Result async = measure([&]() {
+			data = input;
+			quickSortAsync(&data[0], &data[0] + count, depth);
+		}, count);
+		printRow("recursive quicksort", tm, omp, async);
+	}
+	return 0;
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace a7az0th {
+
+	// The kind of a logical processor. Non-hybrid CPUs report only performance cores.
+	enum CoreType {
+		CORE_PERFORMANCE = 0,
+		CORE_EFFICIENCY,
+	};
+
+	// Which cores a thread manager should place its workers on first
+	enum CorePreference {
+		PREFER_NONE = 0,    // Do not pin workers, let the OS decide
+		PREFER_PERFORMANCE, // P-cores first. Meant for latency critical pools
+		PREFER_EFFICIENCY,  // E-cores first. Meant for background pools
+	};
+
+	// OS scheduling class of a thread
+	enum WorkerPriority {
+		PRIORITY_NORMAL = 0, // Same as any other thread
+		PRIORITY_NICE,       // Normal scheduling with a raised nice value
+		PRIORITY_IDLE,       // SCHED_IDLE. Runs only on processors nothing else wants
+	};
+
+	struct CpuInfo {
+		int id;        // OS index of the logical processor
+		int capacity;  // Relative compute capacity, the fastest core has CpuTopology::MAX_CAPACITY
+		CoreType type; // Performance or efficiency core
+	};
+
+	// Parses a sysfs cpu list such as "0-3,8,10-11"
+	inline std::vector<int> parseCpuList(const std::string& list) {
+		std::vector<int> res;
+		std::stringstream ss(list);
+		std::string range;
+		while (std::getline(ss, range, ',')) {
+			if (range.empty()) continue;
+			const size_t dash = range.find('-');
+			const int first = atoi(range.c_str());
+			const int last = (dash == std::string::npos) ? first : atoi(range.c_str() + dash + 1);
+			for (int i = first; i <= last; i++) {
+				res.push_back(i);
+			}
+		}
+		return res;
+	}
+
+	// Describes the logical processors of the machine and how fast each of them is.
+	// All the data comes from sysfs, the root of which can be changed so that a fake tree may be used for testing.
+	class CpuTopology {
+	public:
+		// Capacity of the fastest core. Same scale the kernel uses for cpu_capacity.
+		static const int MAX_CAPACITY = 1024;
+
+		explicit CpuTopology(const std::string& sysfsRoot = "/sys") { detect(sysfsRoot); }
+
+		int getCpuCount(void) const { return int(cpus.size()); }
+		const CpuInfo& getCpu(int i) const { return cpus[i]; }
+
+		// True if the machine has cores of different capacity
+		bool isHybrid(void) const {
+			for (size_t i = 0; i < cpus.size(); i++) {
+				if (cpus[i].type == CORE_EFFICIENCY) return true;
+			}
+			return false;
+		}
+
+		// Returns the OS ids of all cpus, ordered according to the preference given.
+		// Cores of the preferred type come first, ties are broken by capacity and then by id.
+		std::vector<int> getCpuOrder(CorePreference pref) const {
+			std::vector<CpuInfo> sorted(cpus);
+			std::stable_sort(sorted.begin(), sorted.end(), [pref](const CpuInfo& a, const CpuInfo& b) {
+				if (a.type != b.type) {
+					return (pref == PREFER_EFFICIENCY) ? a.type == CORE_EFFICIENCY : a.type == CORE_PERFORMANCE;
+				}
+				if (pref == PREFER_EFFICIENCY) {
+					return a.capacity < b.capacity;
+				}
+				return a.capacity > b.capacity;
+			});
+			std::vector<int> res;
+			for (size_t i = 0; i < sorted.size(); i++) {
+				res.push_back(sorted[i].id);
+			}
+			return res;
+		}
+
+		// Returns the capacity of the cpu with the given OS id. Unknown cpus are considered full capacity.
+		int getCapacity(int cpuId) const {
+			for (size_t i = 0; i < cpus.size(); i++) {
+				if (cpus[i].id == cpuId) return cpus[i].capacity;
+			}
+			return MAX_CAPACITY;
+		}
+
+	private:
+		std::vector<CpuInfo> cpus;
+
+		static bool readFile(const std::string& path, std::string& contents) {
+			std::ifstream f(path.c_str());
+			if (!f) return false;
+			std::getline(f, contents);
+			return true;
+		}
+
+		static int readInt(const std::string& path, int defaultValue) {
+			std::string contents;
+			if (!readFile(path, contents) || contents.empty()) return defaultValue;
+			return atoi(contents.c_str());
+		}
+
+		void detect(const std::string& root) {
+			const std::string cpuDir = root + "/devices/system/cpu/";
+
+			std::string online;
+			std::vector<int> ids;
+			if (readFile(cpuDir + "online", online)) {
+				ids = parseCpuList(online);
+			}
+			if (ids.empty()) {
+				const int count = std::max(1, int(std::thread::hardware_concurrency()));
+				for (int i = 0; i < count; i++) ids.push_back(i);
+			}
+
+			// Arm kernels export the capacity directly. Everything else gets it derived from the max frequency.
+			std::vector<int> capacity(ids.size(), 0);
+			std::vector<int> freq(ids.size(), 0);
+			int maxCapacity = 0, maxFreq = 0;
+			for (size_t i = 0; i < ids.size(); i++) {
+				std::stringstream base;
+				base << cpuDir << "cpu" << ids[i] << "/";
+				capacity[i] = readInt(base.str() + "cpu_capacity", 0);
+				freq[i] = readInt(base.str() + "cpufreq/cpuinfo_max_freq", 0);
+				maxCapacity = std::max(maxCapacity, capacity[i]);
+				maxFreq = std::max(maxFreq, freq[i]);
+			}
+
+			// Intel hybrid parts list their P-cores and E-cores as two separate PMUs
+			std::string atomList;
+			std::vector<int> atoms;
+			if (readFile(root + "/devices/cpu_atom/cpus", atomList)) {
+				atoms = parseCpuList(atomList);
+			}
+
+			cpus.resize(ids.size());
+			for (size_t i = 0; i < ids.size(); i++) {
+				CpuInfo& cpu = cpus[i];
+				cpu.id = ids[i];
+				if (maxCapacity > 0 && capacity[i] > 0) {
+					cpu.capacity = int((long long)(capacity[i]) * MAX_CAPACITY / maxCapacity);
+				} else if (maxFreq > 0 && freq[i] > 0) {
+					cpu.capacity = int((long long)(freq[i]) * MAX_CAPACITY / maxFreq);
+				} else {
+					cpu.capacity = MAX_CAPACITY;
+				}
+
+				if (!atoms.empty()) {
+					const bool isAtom = std::find(atoms.begin(), atoms.end(), cpu.id) != atoms.end();
+					cpu.type = isAtom ? CORE_EFFICIENCY : CORE_PERFORMANCE;
+				} else {
+					// Anything noticeably slower than the fastest core is treated as an efficiency core
+					cpu.type = (cpu.capacity * 5 < MAX_CAPACITY * 4) ? CORE_EFFICIENCY : CORE_PERFORMANCE;
+				}
+			}
+		}
+	};
+
+	// Binds a thread to a single logical processor. Returns false if that is not supported or failed.
+	inline bool setThreadAffinity(std::thread& thread, int cpuId) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpuId, &set);
+		return 0 == pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+		(void)thread;
+		(void)cpuId;
+		return false;
+#endif
+	}
+
+	// Returns the OS id of the calling thread, as used by tools like perf and top. 0 where not supported.
+	inline int getCurrentThreadId(void) {
+#ifdef __linux__
+		return int(syscall(SYS_gettid));
+#else
+		return 0;
+#endif
+	}
+
+	// Returns the processor time the calling thread has consumed, in ns. Time the thread was preempted, blocked, or
+	// (on virtual machines with steal time accounting) lost to the hypervisor is not included. 0 where not supported.
+	inline long long getThreadCpuTimeNs(void) {
+#ifdef __linux__
+		timespec ts;
+		if (0 != clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) return 0;
+		return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#else
+		return 0;
+#endif
+	}
+
+	// Returns how many times the calling thread was descheduled while it could still run. 0 where not supported.
+	inline long long getThreadInvoluntarySwitches(void) {
+#ifdef __linux__
+		rusage usage;
+		if (0 != getrusage(RUSAGE_THREAD, &usage)) return 0;
+		return usage.ru_nivcsw;
+#else
+		return 0;
+#endif
+	}
+
+	// Moves the calling thread to a lower scheduling class. Neither SCHED_IDLE nor raising the nice value needs privileges.
+	// If SCHED_IDLE is not available the thread falls back to the given nice value.
+	// Returns false if that is not supported or failed.
+	inline bool setCurrentThreadPriority(WorkerPriority prio, int niceValue) {
+#ifdef __linux__
+		if (prio == PRIORITY_IDLE) {
+			sched_param param;
+			param.sched_priority = 0;
+			if (0 == pthread_setschedparam(pthread_self(), SCHED_IDLE, &param)) {
+				return true;
+			}
+			prio = PRIORITY_NICE;
+		}
+		if (prio == PRIORITY_NICE) {
+			// On Linux the nice value is per thread, so this leaves the rest of the process alone
+			return 0 == setpriority(PRIO_PROCESS, 0, niceValue);
+		}
+		return true;
+#else
+		(void)niceValue;
+		return prio == PRIORITY_NORMAL;
+#endif
+	}
+
+}//namespace a7az0th
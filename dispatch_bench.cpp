@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#include "threadman.h"
+#include "timer.h"
+
+using namespace a7az0th;
+
+// Measures how long it takes from calling run() until the workers start executing the job.
+// Compares the default Event based wake against busy-polling workers pinned to dedicated cores.
+// Then compares the throughput of submitting small tasks one by one against submitting them in batches.
+//
+// Usage: dispatch_bench [numThreads] [numRuns] [firstSpinCpu]
+// The busy-polling workers are pinned to numThreads consecutive processors starting at firstSpinCpu.
+// For meaningful numbers those processors should be isolated and not shared with the benchmark itself.
+
+struct Probe : MultiThreaded {
+	int64 dispatchTime;          // When run() was called
+	std::atomic<int64> first;    // Earliest start of a worker, relative to dispatchTime
+	std::atomic<int64> last;     // Latest start of a worker, relative to dispatchTime
+
+	void threadProc(int, int) override {
+		const int64 latency = getTimeNs() - dispatchTime;
+		int64 cur = first;
+		while (latency < cur && !first.compare_exchange_weak(cur, latency)) {}
+		cur = last;
+		while (latency > cur && !last.compare_exchange_weak(cur, latency)) {}
+	}
+};
+
+static int64 percentile(std::vector<int64>& samples, double p) {
+	std::sort(samples.begin(), samples.end());
+	const size_t i = std::min(samples.size() - 1, size_t(p * samples.size()));
+	return samples[i];
+}
+
+static void report(const char* name, std::vector<int64>& samples) {
+	printf("%-12s p50 %8lld  p90 %8lld  p99 %8lld  p99.9 %8lld  max %8lld ns\n", name,
+		percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99),
+		percentile(samples, 0.999), percentile(samples, 1.0));
+}
+
+static void measure(const char* name, ThreadManager& threadman, int numThreads, int numRuns) {
+	std::vector<int64> firstStart, allStarted, roundTrip;
+	Probe probe;
+	// Warm up the pool so thread creation is not measured
+	for (int i = 0; i < 100; i++) {
+		probe.dispatchTime = getTimeNs();
+		probe.first = probe.last = 0;
+		threadman.run(&probe, numThreads);
+	}
+	for (int i = 0; i < numRuns; i++) {
+		probe.first = 1LL << 62;
+		probe.last = 0;
+		probe.dispatchTime = getTimeNs();
+		threadman.run(&probe, numThreads);
+		roundTrip.push_back(getTimeNs() - probe.dispatchTime);
+		firstStart.push_back(probe.first);
+		allStarted.push_back(probe.last);
+	}
+	printf("%s, %d workers, %d runs\n", name, numThreads, numRuns);
+	report("first start", firstStart);
+	report("all started", allStarted);
+	report("round trip", roundTrip);
+}
+
+static void measureSubmit(int numTasks, int batchSize) {
+	ThreadManager threadman;
+	threadman.warmup();
+	std::atomic<int64> sum(0);
+	const auto task = [&sum]() { sum++; };
+	std::vector<Task> batch;
+	batch.reserve(batchSize);
+
+	Timer timer;
+	for (int i = 0; i < numTasks; i++) {
+		threadman.submit(task);
+	}
+	threadman.waitForTasks();
+	timer.stop();
+	const double single = double(timer.elapsed(Timer::Nanoseconds));
+
+	timer.start();
+	for (int i = 0; i < numTasks; i += batchSize) {
+		batch.clear();
+		for (int k = i; k < std::min(numTasks, i + batchSize); k++) {
+			batch.push_back(task);
+		}
+		threadman.submitBulk(batch.begin(), batch.end());
+	}
+	threadman.waitForTasks();
+	timer.stop();
+	const double bulk = double(timer.elapsed(Timer::Nanoseconds));
+
+	printf("Task submission, %d tasks\n", numTasks);
+	printf("%-12s %10.2f Mtasks/s\n", "submit", numTasks / single * 1e3);
+	printf("%-12s %10.2f Mtasks/s, batches of %d\n", "submitBulk", numTasks / bulk * 1e3, batchSize);
+}
+
+int main(int argc, char* argv[]) {
+	const int numProcs = getProcessorCount();
+	const int numThreads = (argc > 1) ? atoi(argv[1]) : std::max(2, std::min(4, numProcs - 1));
+	const int numRuns = (argc > 2) ? atoi(argv[2]) : 10000;
+	const int firstSpinCpu = (argc > 3) ? atoi(argv[3]) : std::max(0, numProcs - numThreads);
+
+	if (numProcs <= numThreads) {
+		printf("Warning: %d processors for %d busy-polling workers and the caller. Numbers will be dominated by preemption\n",
+			numProcs, numThreads);
+	}
+
+	{
+		ThreadManager threadman;
+		measure("Event wake", threadman, numThreads, numRuns);
+	}
+	{
+		std::vector<int> cpus;
+		for (int i = 0; i < numThreads; i++) {
+			cpus.push_back((firstSpinCpu + i) % numProcs);
+		}
+		ThreadManager threadman;
+		threadman.setBusyPolling(cpus);
+		measure("Busy polling", threadman, numThreads, numRuns);
+	}
+	measureSubmit(numRuns * 100, 1000);
+	return 0;
+}
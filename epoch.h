@@ -0,0 +1,325 @@
+#pragma once
+
+// Epoch-based memory reclamation for lock-free structures. A thread reads shared nodes only inside an EpochGuard.
+// A node unlinked from a structure is retired instead of deleted, and freed once every thread that was inside a
+// guard at that time has left it - so readers never touch freed memory, and they pay no reference counting.
+//
+// There is a global epoch. Entering a guard publishes the epoch the thread entered in, in the slot of the thread.
+// The epoch advances once all threads inside guards have seen the current one. A node retired in epoch E can be
+// freed when the global epoch reaches E + 2: by then nobody that could have seen it is still inside a guard.
+// Every thread, including pool workers, gets its slot the first time it uses the reclaimer and gives it back
+// when it exits. Retired nodes wait in three limbo lists per slot, one for each epoch still in flight.
+// Reclamation is amortized: every COLLECT_INTERVAL retirements the thread tries to advance the epoch and frees
+// its own lists that have become safe.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "threadman.h"
+
+namespace a7az0th {
+
+	class EpochReclaimer {
+	public:
+		// How many live threads can use the reclaimer. One more aborts the process
+		static const int MAX_SLOTS = 4 * MAX_CPU_COUNT;
+		// How many nodes a thread retires between two attempts to reclaim
+		static const int COLLECT_INTERVAL = 64;
+
+		// Marks the calling thread as reading shared nodes. Guards nest
+		static void enter(void) {
+			Slot* s = getSlot();
+			if (s->nesting++ == 0) {
+				const int64 epoch = get().epoch.load(std::memory_order_relaxed);
+				s->local.store((epoch << 1) | 1, std::memory_order_relaxed);
+				// The slot has to be visible before the thread reads any node, or a reclaimer may miss it
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+		}
+
+		static void leave(void) {
+			Slot* s = getSlot();
+			if (--s->nesting == 0) {
+				s->local.store(0, std::memory_order_release);
+			}
+		}
+
+		// Frees p with deleter once no thread can still be reading it. p must already be unreachable for new readers
+		static void retire(void* p, void (*deleter)(void*)) {
+			EpochReclaimer& r = get();
+			Slot* s = getSlot();
+			const int64 epoch = r.epoch.load(std::memory_order_seq_cst);
+			Bag& bag = s->bags[epoch % 3];
+			if (bag.epoch != epoch) {
+				// The bag holds nodes from three epochs ago, which are safe by now
+				freeBag(bag);
+				bag.epoch = epoch;
+			}
+			Retired item = { p, deleter };
+			bag.items.push_back(item);
+			if (++s->retiredSinceCollect >= COLLECT_INTERVAL) {
+				s->retiredSinceCollect = 0;
+				collect(s);
+			}
+		}
+
+		// Deletes p once no thread can still be reading it
+		template <class T>
+		static void retire(T* p) {
+			retire(p, &deleteObject<T>);
+		}
+
+		// Waits until every node retired so far by the calling thread can be freed, and frees them.
+		// Must not be called inside a guard.
+		static void synchronize(void) {
+			Slot* s = getSlot();
+			assert(s->nesting == 0);
+			EpochReclaimer& r = get();
+			const int64 target = r.epoch.load(std::memory_order_seq_cst) + 2;
+			while (r.epoch.load(std::memory_order_acquire) < target) {
+				if (!tryAdvance()) {
+					std::this_thread::yield();
+				}
+			}
+			for (int i = 0; i < 3; i++) {
+				freeBag(s->bags[i]);
+			}
+			freeOrphans();
+		}
+
+		// Returns the current global epoch
+		static int64 getEpoch(void) { return get().epoch.load(std::memory_order_relaxed); }
+
+	private:
+		struct Retired {
+			void* p;
+			void (*deleter)(void*);
+		};
+
+		// Nodes retired in the same epoch
+		struct Bag {
+			int64 epoch;
+			std::vector<Retired> items;
+			Bag() : epoch(-1) {}
+		};
+
+		struct alignas(CACHE_LINE_SIZE) Slot {
+			std::atomic<int64> local;    // (epoch << 1) | 1 while the owner is inside a guard, 0 otherwise
+			std::atomic<bool> used;      // The slot belongs to a live thread
+			int nesting;                 // Depth of guards of the owner
+			int retiredSinceCollect;
+			Bag bags[3];                 // Limbo lists, indexed by epoch % 3. Only touched by the owner
+		};
+
+		// Releases the slot of a thread when it exits
+		struct ThreadSlot {
+			Slot* slot;
+			ThreadSlot() : slot(NULL) {}
+			~ThreadSlot() {
+				if (slot) get().release(slot);
+			}
+		};
+
+		std::atomic<int64> epoch;
+		std::atomic<int> numSlots;  // Slots handed out so far. Reclaimers only look at these
+		Slot slots[MAX_SLOTS];
+		Mutex orphanLock;           // Guards orphans
+		std::vector<Bag> orphans;   // Limbo lists of threads that exited before they could free them
+		std::atomic<int> numOrphans; // Size of orphans, readable without the lock
+
+		EpochReclaimer() : epoch(0), numSlots(0), numOrphans(0) {
+			for (int i = 0; i < MAX_SLOTS; i++) {
+				slots[i].local = 0;
+				slots[i].used = false;
+				slots[i].nesting = 0;
+				slots[i].retiredSinceCollect = 0;
+			}
+			orphanLock.setName("EpochReclaimer::orphans");
+		}
+
+		// Never destroyed: threads of a global ThreadManager may exit, and give back their slots, after static
+		// destructors have run. Constructed in static storage, since new ignores the alignment of the slots before C++17
+		static EpochReclaimer& get(void) {
+			static typename std::aligned_storage<sizeof(EpochReclaimer), alignof(EpochReclaimer)>::type storage;
+			static EpochReclaimer* reclaimer = new (&storage) EpochReclaimer;
+			return *reclaimer;
+		}
+
+		static Slot* getSlot(void) {
+			static thread_local ThreadSlot thread;
+			if (!thread.slot) {
+				thread.slot = get().acquire();
+			}
+			return thread.slot;
+		}
+
+		// More live threads than slots is a hard error. Waiting for a thread to exit could wait forever, and sharing
+		// a slot would let one thread's guard hide the other's
+		Slot* acquire(void) {
+			for (int i = 0; i < MAX_SLOTS; i++) {
+				bool expected = false;
+				if (!slots[i].used.load(std::memory_order_relaxed) &&
+					slots[i].used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+					int n = numSlots.load(std::memory_order_relaxed);
+					while (n < i + 1 && !numSlots.compare_exchange_weak(n, i + 1, std::memory_order_release)) {}
+					return &slots[i];
+				}
+			}
+			fprintf(stderr, "threadman: more than %d live threads use the EpochReclaimer\n", MAX_SLOTS);
+			abort();
+		}
+
+		// Hands the limbo lists of an exiting thread to the orphans and frees the ones that are already safe
+		void release(Slot* s) {
+			{
+				MutexRAII lock(orphanLock);
+				for (int i = 0; i < 3; i++) {
+					if (!s->bags[i].items.empty()) {
+						orphans.push_back(Bag());
+						orphans.back().epoch = s->bags[i].epoch;
+						orphans.back().items.swap(s->bags[i].items);
+					}
+					s->bags[i].epoch = -1;
+				}
+				numOrphans.store(int(orphans.size()), std::memory_order_relaxed);
+			}
+			s->nesting = 0;
+			s->retiredSinceCollect = 0;
+			s->local.store(0, std::memory_order_relaxed);
+			s->used.store(false, std::memory_order_release);
+			// The last threads to exit may leave no one behind to collect, so try to free what we can right away
+			tryAdvance();
+			freeOrphans();
+		}
+
+		// Advances the global epoch if every thread inside a guard has entered it in the current epoch
+		static bool tryAdvance(void) {
+			EpochReclaimer& r = get();
+			int64 cur = r.epoch.load(std::memory_order_seq_cst);
+			const int n = r.numSlots.load(std::memory_order_acquire);
+			for (int i = 0; i < n; i++) {
+				const int64 local = r.slots[i].local.load(std::memory_order_seq_cst);
+				if ((local & 1) && (local >> 1) != cur) return false;
+			}
+			return r.epoch.compare_exchange_strong(cur, cur + 1, std::memory_order_seq_cst);
+		}
+
+		// Tries to advance the epoch and frees the bags of the slot that have become safe
+		static void collect(Slot* s) {
+			tryAdvance();
+			const int64 safe = get().epoch.load(std::memory_order_seq_cst) - 2;
+			for (int i = 0; i < 3; i++) {
+				if (s->bags[i].epoch >= 0 && s->bags[i].epoch <= safe) {
+					freeBag(s->bags[i]);
+				}
+			}
+			freeOrphans();
+		}
+
+		// Frees the orphaned bags that have become safe. Skipped if another thread is at it
+		static void freeOrphans(void) {
+			EpochReclaimer& r = get();
+			if (r.numOrphans.load(std::memory_order_relaxed) == 0) return; // A missed orphan is freed next time
+			std::vector<Bag> ready;
+			{
+				MutexRAII lock(r.orphanLock);
+				const int64 safe = r.epoch.load(std::memory_order_seq_cst) - 2;
+				for (size_t i = 0; i < r.orphans.size();) {
+					if (r.orphans[i].epoch <= safe) {
+						ready.push_back(Bag());
+						ready.back().items.swap(r.orphans[i].items);
+						r.orphans[i].items.swap(r.orphans.back().items);
+						r.orphans[i].epoch = r.orphans.back().epoch;
+						r.orphans.pop_back();
+					} else {
+						i++;
+					}
+				}
+				r.numOrphans.store(int(r.orphans.size()), std::memory_order_relaxed);
+			}
+			for (size_t i = 0; i < ready.size(); i++) {
+				freeBag(ready[i]);
+			}
+		}
+
+		static void freeBag(Bag& bag) {
+			for (size_t i = 0; i < bag.items.size(); i++) {
+				bag.items[i].deleter(bag.items[i].p);
+			}
+			bag.items.clear();
+		}
+
+		template <class T>
+		static void deleteObject(void* p) { delete static_cast<T*>(p); }
+
+		EpochReclaimer(const EpochReclaimer&) = delete;
+		EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+	};
+
+	// Keeps the nodes the calling thread reads from being freed while it is alive
+	struct EpochGuard {
+		EpochGuard() { EpochReclaimer::enter(); }
+		~EpochGuard() { EpochReclaimer::leave(); }
+	private:
+		EpochGuard(const EpochGuard&) = delete;
+		EpochGuard& operator=(const EpochGuard&) = delete;
+	};
+
+	// A lock-free LIFO stack (Treiber stack). Popped nodes are reclaimed through the EpochReclaimer,
+	// which also rules out the ABA problem: a node's memory is not reused while any thread may still hold it.
+	// At most EpochReclaimer::MAX_SLOTS live threads can have popped: a thread holds a slot from its first pop until
+	// it exits, and the process aborts if one more thread pops.
+	template <class T>
+	class LockFreeStack {
+	public:
+		LockFreeStack() : head(NULL) {}
+		~LockFreeStack() {
+			Node* n = head.load(std::memory_order_relaxed);
+			while (n) {
+				Node* next = n->next;
+				delete n;
+				n = next;
+			}
+		}
+
+		void push(T value) {
+			Node* n = new Node(std::move(value));
+			n->next = head.load(std::memory_order_relaxed);
+			while (!head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {}
+		}
+
+		// Moves the top element to res. Returns false if the stack is empty
+		bool pop(T& res) {
+			EpochGuard guard;
+			Node* n = head.load(std::memory_order_acquire);
+			while (n && !head.compare_exchange_weak(n, n->next, std::memory_order_acquire, std::memory_order_acquire)) {}
+			if (!n) return false;
+			res = std::move(n->value);
+			EpochReclaimer::retire(n);
+			return true;
+		}
+
+		// Whether the stack was empty at the time of the call
+		bool empty(void) const { return head.load(std::memory_order_acquire) == NULL; }
+
+	private:
+		struct Node {
+			T value;
+			Node* next;
+			explicit Node(T&& value) : value(std::move(value)), next(NULL) {}
+		};
+
+		std::atomic<Node*> head;
+
+		LockFreeStack(const LockFreeStack&) = delete;
+		LockFreeStack& operator=(const LockFreeStack&) = delete;
+	};
+
+}//namespace a7az0th
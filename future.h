@@ -0,0 +1,412 @@
+#pragma once
+
+// Futures tied to a ThreadManager. async() runs a callable as a pool task and returns a Future of its result.
+// Future::then attaches a continuation that is submitted to the pool once the result is there, so a chain of
+// asynchronous steps never holds a thread waiting. whenAll and whenAny combine futures.
+//
+// A future's shared state is an atomic list of continuations and a reference count - there is no mutex or
+// condition variable per future. Threads that do block in get() park on one of a few stripes of a global
+// parking lot, picked by the address of the state. Tasks must not throw.
+
+#include <stddef.h>
+#include <assert.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <vector>
+
+#include "threadman.h"
+#include "task.h"
+
+namespace a7az0th {
+
+	// The value of a Future<void>
+	struct Void {};
+
+	template <class T> class Future;
+
+	namespace detail {
+
+		// Threads waiting for futures park here. Stripes are shared between futures, a waiter rechecks its own
+		// future after every wakeup.
+		struct ParkingLot {
+			struct alignas(CACHE_LINE_SIZE) Stripe {
+				std::mutex m;
+				std::condition_variable c;
+			};
+			static const int STRIPES = 32;
+
+			static Stripe& get(const void* addr) {
+				static Stripe stripes[STRIPES];
+				return stripes[(size_t(addr) / CACHE_LINE_SIZE) % STRIPES];
+			}
+		};
+
+		// Where continuations go. Type-erases the policy of the ThreadManager
+		struct FutureExecutor {
+			void* pool;
+			void (*submit)(void* pool, Task&& task);
+			bool (*runPending)(void* pool);
+
+			template <class Policy>
+			static FutureExecutor make(ThreadManagerT<Policy>& threadman) {
+				FutureExecutor res = { &threadman, &submitTo<Policy>, &runPendingOn<Policy> };
+				return res;
+			}
+
+			// Runs continuations on the thread that attaches them, for futures not tied to any pool
+			static FutureExecutor makeInline(void) {
+				FutureExecutor res = { NULL, &submitInline, &runNothing };
+				return res;
+			}
+
+		private:
+			template <class Policy>
+			static void submitTo(void* pool, Task&& task) { static_cast<ThreadManagerT<Policy>*>(pool)->submit(std::move(task)); }
+			template <class Policy>
+			static bool runPendingOn(void* pool) { return static_cast<ThreadManagerT<Policy>*>(pool)->runPendingTask(); }
+			static void submitInline(void*, Task&& task) { task(); }
+			static bool runNothing(void*) { return false; }
+		};
+
+		struct Continuation {
+			Task task;
+			bool runInline; // Run on the thread completing the future instead of submitting it. Only for trivial work
+			Continuation* next;
+		};
+
+		// The shared state of a future, apart from the value
+		class FutureStateBase {
+		public:
+			explicit FutureStateBase(const FutureExecutor& executor)
+				: refs(1), continuations(NULL), waiters(false), executor(executor) {}
+			virtual ~FutureStateBase() {}
+
+			void addRef(void) { refs.fetch_add(1, std::memory_order_relaxed); }
+			void release(void) {
+				if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					delete this;
+				}
+			}
+
+			bool isReady(void) const { return continuations.load(std::memory_order_acquire) == completed(); }
+
+			// Runs task once the state is ready - right away if it already is
+			void addContinuation(Task&& task, bool runInline) {
+				Continuation* head = continuations.load(std::memory_order_acquire);
+				if (head != completed()) {
+					Continuation* c = new Continuation;
+					c->task = std::move(task);
+					c->runInline = runInline;
+					c->next = head;
+					while (!continuations.compare_exchange_weak(c->next, c, std::memory_order_acq_rel, std::memory_order_acquire)) {
+						if (c->next == completed()) {
+							task = std::move(c->task);
+							delete c;
+							break;
+						}
+					}
+					if (!task) return;
+				}
+				dispatch(task, runInline);
+			}
+
+			// Blocks until the state is ready. Runs queued pool tasks in the meantime, so waiting on a worker
+			// does not starve the task that would complete the future.
+			void wait(void) {
+				while (!isReady()) {
+					if (executor.runPending(executor.pool)) continue;
+					ParkingLot::Stripe& s = ParkingLot::get(this);
+					std::unique_lock<std::mutex> lock(s.m);
+					// Pairs with markReady: either it sees the flag or we see the value
+					waiters.store(true, std::memory_order_seq_cst);
+					if (continuations.load(std::memory_order_seq_cst) == completed()) break;
+					// The timeout rechecks the task queue, in case the task completing us was queued after we looked
+					s.c.wait_for(lock, std::chrono::milliseconds(1));
+				}
+			}
+
+			FutureExecutor getExecutor(void) const { return executor; }
+
+		protected:
+			// Publishes the value set by the derived class and runs the continuations, oldest first
+			void markReady(void) {
+				Continuation* list = continuations.exchange(completed(), std::memory_order_seq_cst);
+				Continuation* ordered = NULL;
+				while (list) {
+					Continuation* next = list->next;
+					list->next = ordered;
+					ordered = list;
+					list = next;
+				}
+				if (waiters.load(std::memory_order_seq_cst)) {
+					ParkingLot::Stripe& s = ParkingLot::get(this);
+					std::lock_guard<std::mutex> lock(s.m);
+					s.c.notify_all();
+				}
+				while (ordered) {
+					Continuation* next = ordered->next;
+					dispatch(ordered->task, ordered->runInline);
+					delete ordered;
+					ordered = next;
+				}
+			}
+
+		private:
+			std::atomic<int> refs;
+			std::atomic<Continuation*> continuations; // completed() once the value is set
+			std::atomic<bool> waiters;                // Someone may be parked on the stripe of this state
+			const FutureExecutor executor;
+
+			static Continuation* completed(void) {
+				static Continuation sentinel;
+				return &sentinel;
+			}
+
+			void dispatch(Task& task, bool runInline) {
+				if (runInline) {
+					task();
+				} else {
+					executor.submit(executor.pool, std::move(task));
+				}
+			}
+
+			FutureStateBase(const FutureStateBase&) = delete;
+			FutureStateBase& operator=(const FutureStateBase&) = delete;
+		};
+
+		template <class T>
+		class FutureState : public FutureStateBase {
+		public:
+			typedef typename std::conditional<std::is_void<T>::value, Void, T>::type Value;
+
+			explicit FutureState(const FutureExecutor& executor) : FutureStateBase(executor) {}
+			~FutureState() {
+				if (isReady()) get().~Value();
+			}
+
+			template <class V>
+			void set(V&& value) {
+				new (storage) Value(std::forward<V>(value));
+				markReady();
+			}
+
+			// Only valid once ready
+			Value& get(void) { return *reinterpret_cast<Value*>(storage); }
+
+		private:
+			typename std::aligned_storage<sizeof(Value), alignof(Value)>::type storage[1];
+		};
+
+		// Calls f, with the value of the antecedent unless it is a Future<void>, and stores the result in state
+		template <class R>
+		struct Invoke {
+			template <class F, class... Args>
+			static void run(FutureState<R>* state, F& f, Args&... args) { state->set(f(args...)); }
+		};
+		template <>
+		struct Invoke<void> {
+			template <class F, class... Args>
+			static void run(FutureState<void>* state, F& f, Args&... args) {
+				f(args...);
+				state->set(Void());
+			}
+		};
+
+		template <class F, class T>
+		struct ContinuationResult { typedef typename std::result_of<F&(T&)>::type type; };
+		template <class F>
+		struct ContinuationResult<F, void> { typedef typename std::result_of<F&()>::type type; };
+
+	}//namespace detail
+
+	// The result of an asynchronous computation. Copies share the result, like std::shared_future.
+	// A default constructed Future is empty, see valid().
+	template <class T>
+	class Future {
+	public:
+		typedef typename detail::FutureState<T>::Value Value;
+
+		Future() : state(NULL) {}
+		~Future() {
+			if (state) state->release();
+		}
+		Future(const Future& rhs) : state(rhs.state) {
+			if (state) state->addRef();
+		}
+		Future(Future&& rhs) noexcept : state(rhs.state) { rhs.state = NULL; }
+		Future& operator=(Future rhs) {
+			std::swap(state, rhs.state);
+			return *this;
+		}
+
+		bool valid(void) const { return state != NULL; }
+		bool isReady(void) const { return state->isReady(); }
+
+		// Blocks until the result is there. Prefer then() - a blocked thread cannot do anything else,
+		// although a blocked thread does run queued pool tasks while it waits
+		void wait(void) const { state->wait(); }
+
+		// Waits for the result and returns it. A Future<void> returns a Void
+		Value& get(void) const {
+			state->wait();
+			return state->get();
+		}
+
+		// Runs f on a pool worker once the result is there and returns a future of what f returns.
+		// f is called with the result, or with no arguments for a Future<void>.
+		template <class F>
+		Future<typename detail::ContinuationResult<typename std::decay<F>::type, T>::type> then(F&& f) const {
+			typedef typename std::decay<F>::type Callable;
+			typedef typename detail::ContinuationResult<Callable, T>::type R;
+			detail::FutureState<R>* next = new detail::FutureState<R>(state->getExecutor());
+			next->addRef();
+			state->addRef();
+			detail::FutureState<T>* antecedent = state;
+			state->addContinuation(Task(ThenTask<Callable, R>(std::forward<F>(f), antecedent, next)), false);
+			return Future<R>(next);
+		}
+
+	private:
+		detail::FutureState<T>* state;
+
+		explicit Future(detail::FutureState<T>* state) : state(state) {}
+
+		template <class F, class R>
+		struct ThenTask {
+			F f;
+			detail::FutureState<T>* antecedent; // Both referenced until the task has run
+			detail::FutureState<R>* next;
+
+			ThenTask(F&& f, detail::FutureState<T>* antecedent, detail::FutureState<R>* next)
+				: f(std::move(f)), antecedent(antecedent), next(next) {}
+			ThenTask(const F& f, detail::FutureState<T>* antecedent, detail::FutureState<R>* next)
+				: f(f), antecedent(antecedent), next(next) {}
+			ThenTask(ThenTask&& rhs) noexcept
+				: f(std::move(rhs.f)), antecedent(rhs.antecedent), next(rhs.next) {
+				rhs.antecedent = NULL;
+				rhs.next = NULL;
+			}
+			~ThenTask() {
+				if (antecedent) antecedent->release();
+				if (next) next->release();
+			}
+			void operator()(void) {
+				call(std::is_void<T>());
+				antecedent->release();
+				next->release();
+				antecedent = NULL;
+				next = NULL;
+			}
+			void call(std::true_type) { detail::Invoke<R>::run(next, f); }
+			void call(std::false_type) { detail::Invoke<R>::run(next, f, antecedent->get()); }
+		};
+
+		template <class U> friend class Future;
+		template <class Policy, class F>
+		friend Future<typename std::result_of<typename std::decay<F>::type&()>::type> async(ThreadManagerT<Policy>&, F&&);
+		template <class U>
+		friend Future<std::vector<Future<U>>> whenAll(const std::vector<Future<U>>&);
+		template <class U>
+		friend Future<size_t> whenAny(const std::vector<Future<U>>&);
+	};
+
+	// Runs f as a task on the pool and returns a future of its result
+	template <class Policy, class F>
+	Future<typename std::result_of<typename std::decay<F>::type&()>::type> async(ThreadManagerT<Policy>& threadman, F&& f) {
+		typedef typename std::decay<F>::type Callable;
+		typedef typename std::result_of<Callable&()>::type R;
+		detail::FutureState<R>* state = new detail::FutureState<R>(detail::FutureExecutor::make(threadman));
+		state->addRef();
+		struct AsyncTask {
+			Callable f;
+			detail::FutureState<R>* state;
+			AsyncTask(Callable&& f, detail::FutureState<R>* state) : f(std::move(f)), state(state) {}
+			AsyncTask(AsyncTask&& rhs) noexcept : f(std::move(rhs.f)), state(rhs.state) { rhs.state = NULL; }
+			~AsyncTask() {
+				if (state) state->release();
+			}
+			void operator()(void) {
+				detail::Invoke<R>::run(state, f);
+				state->release();
+				state = NULL;
+			}
+		};
+		threadman.submit(Task(AsyncTask(Callable(std::forward<F>(f)), state)));
+		return Future<R>(state);
+	}
+
+	// Returns a future that becomes ready when all of the given futures are, with the futures as its value.
+	// Every future must be valid. Given none, the result is ready right away and its continuations run on the
+	// thread that attaches them.
+	template <class T>
+	Future<std::vector<Future<T>>> whenAll(const std::vector<Future<T>>& futures) {
+		typedef std::vector<Future<T>> Futures;
+		struct AllState : detail::FutureState<Futures> {
+			std::atomic<size_t> remaining;
+			Futures futures;
+			AllState(const Futures& futures, const detail::FutureExecutor& executor)
+				: detail::FutureState<Futures>(executor), remaining(futures.size()), futures(futures) {}
+			void arrive(void) {
+				if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					this->set(std::move(futures));
+				}
+			}
+		};
+		if (futures.empty()) {
+			AllState* none = new AllState(futures, detail::FutureExecutor::makeInline());
+			none->set(Futures());
+			return Future<Futures>(none);
+		}
+		AllState* all = new AllState(futures, futures[0].state->getExecutor());
+		for (size_t i = 0; i < futures.size(); i++) {
+			all->addRef();
+			struct Arrive {
+				AllState* all;
+				void operator()(void) {
+					all->arrive();
+					all->release();
+				}
+			};
+			Arrive arrive = { all };
+			futures[i].state->addContinuation(Task(arrive), true);
+		}
+		return Future<Futures>(all);
+	}
+
+	// Returns a future that becomes ready as soon as one of the given futures is, with its index as the value.
+	// Every future must be valid, and there must be at least one - no index could ever be the value otherwise.
+	template <class T>
+	Future<size_t> whenAny(const std::vector<Future<T>>& futures) {
+		struct AnyState : detail::FutureState<size_t> {
+			std::atomic<bool> decided;
+			AnyState(const detail::FutureExecutor& executor) : detail::FutureState<size_t>(executor), decided(false) {}
+			void arrive(size_t index) {
+				if (!decided.exchange(true, std::memory_order_acq_rel)) {
+					this->set(index);
+				}
+			}
+		};
+		assert(!futures.empty() && "whenAny needs at least one future");
+		AnyState* any = new AnyState(futures[0].state->getExecutor());
+		for (size_t i = 0; i < futures.size(); i++) {
+			any->addRef();
+			struct Arrive {
+				AnyState* any;
+				size_t index;
+				void operator()(void) {
+					any->arrive(index);
+					any->release();
+				}
+			};
+			Arrive arrive = { any, i };
+			futures[i].state->addContinuation(Task(arrive), true);
+		}
+		return Future<size_t>(any);
+	}
+
+}//namespace a7az0th
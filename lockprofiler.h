@@ -0,0 +1,206 @@
+#pragma once
+
+// Contention profiling for Mutex. Every acquisition is recorded for its lock and its call site - the line that
+// entered the mutex, or constructed the MutexRAII. LockProfiler::report prints for every lock and call site how
+// often it was taken, how often it had to wait, the total and longest wait and how long it was held,
+// sorted by total wait.
+// Name locks with Mutex::setName to tell them apart in the report. Unnamed locks are shown by address.
+//
+// Only compiled in if THREADMAN_LOCK_PROFILING is defined. Otherwise Mutex is a plain std::mutex wrapper.
+
+#include <stdio.h>
+
+#ifdef THREADMAN_LOCK_PROFILING
+
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "timer.h"
+
+namespace a7az0th {
+
+	// Statistics of a single lock at a single call site
+	struct LockSiteStats {
+		std::atomic<int> state;         // 0 if the entry is free, 1 while it is being claimed, 2 once the key is valid
+		const void* lock;               // The Mutex
+		const char* file;               // Call site
+		int line;
+		std::atomic<const char*> name;  // Name of the lock, if it has one
+		std::atomic<int64> acquisitions;
+		std::atomic<int64> contended;   // Acquisitions that had to wait
+		std::atomic<int64> waitNs;      // Total time spent waiting
+		std::atomic<int64> maxWaitNs;
+		std::atomic<int64> holdNs;      // Total time the lock was held
+		std::atomic<int64> maxHoldNs;
+	};
+
+	class LockProfiler {
+	public:
+		// How many lock and call site pairs can be recorded. Further ones are counted in the report as dropped
+		static const int MAX_SITES = 4096;
+
+		// Returns the entry for a lock at a call site, creating it on first use. NULL if the table is full.
+		// Lock-free - concurrent callers with the same key get the same entry.
+		static LockSiteStats* getSite(const void* lock, const char* file, int line) {
+			LockProfiler& p = get();
+			size_t h = size_t(lock) * 31 + size_t(file) * 17 + size_t(line);
+			h ^= h >> 15;
+			for (int probe = 0; probe < MAX_SITES; probe++) {
+				LockSiteStats& s = p.sites[(h + probe) % MAX_SITES];
+				int st = s.state.load(std::memory_order_acquire);
+				if (st == 0) {
+					if (s.state.compare_exchange_strong(st, 1, std::memory_order_acquire)) {
+						s.lock = lock;
+						s.file = file;
+						s.line = line;
+						s.state.store(2, std::memory_order_release);
+						return &s;
+					}
+				}
+				while (st == 1) {
+					st = s.state.load(std::memory_order_acquire);
+				}
+				if (s.lock == lock && s.file == file && s.line == line) {
+					return &s;
+				}
+			}
+			p.dropped++;
+			return NULL;
+		}
+
+		// Records a single acquisition
+		static void recordAcquire(LockSiteStats* s, const char* name, int64 waitNs, bool contended) {
+			if (!s) return;
+			s->acquisitions.fetch_add(1, std::memory_order_relaxed);
+			if (contended) {
+				s->contended.fetch_add(1, std::memory_order_relaxed);
+				s->waitNs.fetch_add(waitNs, std::memory_order_relaxed);
+				updateMax(s->maxWaitNs, waitNs);
+			}
+			if (name && s->name.load(std::memory_order_relaxed) != name) {
+				s->name.store(name, std::memory_order_relaxed);
+			}
+		}
+
+		// Records how long the lock was held after an acquisition
+		static void recordRelease(LockSiteStats* s, int64 holdNs) {
+			if (!s) return;
+			s->holdNs.fetch_add(holdNs, std::memory_order_relaxed);
+			updateMax(s->maxHoldNs, holdNs);
+		}
+
+		// Prints every lock sorted by total wait, each followed by its call sites sorted by wait
+		// @param maxLocks How many locks to print
+		static void report(FILE* out = stdout, int maxLocks = 20) {
+			LockProfiler& p = get();
+			struct Row {
+				const LockSiteStats* site;
+				int64 acquisitions, contended, waitNs, maxWaitNs, holdNs, maxHoldNs;
+			};
+			std::vector<Row> sites;
+			for (int i = 0; i < MAX_SITES; i++) {
+				const LockSiteStats& s = p.sites[i];
+				if (s.state.load(std::memory_order_acquire) != 2 || s.acquisitions == 0) continue;
+				Row row = { &s, s.acquisitions, s.contended, s.waitNs, s.maxWaitNs, s.holdNs, s.maxHoldNs };
+				sites.push_back(row);
+			}
+			// Per lock totals
+			std::vector<Row> locks;
+			for (size_t i = 0; i < sites.size(); i++) {
+				size_t l = 0;
+				while (l < locks.size() && locks[l].site->lock != sites[i].site->lock) l++;
+				if (l == locks.size()) {
+					Row row = sites[i];
+					row.acquisitions = row.contended = row.waitNs = row.maxWaitNs = row.holdNs = row.maxHoldNs = 0;
+					locks.push_back(row);
+				}
+				Row& lock = locks[l];
+				const Row& site = sites[i];
+				lock.acquisitions += site.acquisitions;
+				lock.contended += site.contended;
+				lock.waitNs += site.waitNs;
+				lock.maxWaitNs = std::max(lock.maxWaitNs, site.maxWaitNs);
+				lock.holdNs += site.holdNs;
+				lock.maxHoldNs = std::max(lock.maxHoldNs, site.maxHoldNs);
+				if (!lock.site->name && site.site->name) lock.site = site.site;
+			}
+			const auto byWait = [](const Row& a, const Row& b) { return a.waitNs > b.waitNs; };
+			std::sort(locks.begin(), locks.end(), byWait);
+			std::sort(sites.begin(), sites.end(), byWait);
+
+			fprintf(out, "%-40s %10s %10s %7s %11s %11s %11s %11s\n",
+				"lock / call site", "acquired", "contended", "cont %", "wait ms", "max wait us", "hold ms", "max hold us");
+			for (size_t l = 0; l < locks.size() && int(l) < maxLocks; l++) {
+				char title[64];
+				const char* name = locks[l].site->name;
+				if (name) {
+					snprintf(title, sizeof(title), "%s", name);
+				} else {
+					snprintf(title, sizeof(title), "lock %p", locks[l].site->lock);
+				}
+				printRow(out, title, locks[l]);
+				for (size_t i = 0; i < sites.size(); i++) {
+					if (sites[i].site->lock != locks[l].site->lock) continue;
+					const char* file = sites[i].site->file ? sites[i].site->file : "?";
+					const char* slash = strrchr(file, '/');
+					snprintf(title, sizeof(title), "  %s:%d", slash ? slash + 1 : file, sites[i].site->line);
+					printRow(out, title, sites[i]);
+				}
+			}
+			if (p.dropped > 0) {
+				fprintf(out, "%lld acquisitions not recorded, the site table is full\n", (long long)p.dropped);
+			}
+		}
+
+		// Clears all counters. Locks and call sites stay registered
+		static void reset(void) {
+			LockProfiler& p = get();
+			for (int i = 0; i < MAX_SITES; i++) {
+				LockSiteStats& s = p.sites[i];
+				s.acquisitions = s.contended = s.waitNs = s.maxWaitNs = s.holdNs = s.maxHoldNs = 0;
+			}
+			p.dropped = 0;
+		}
+
+	private:
+		LockSiteStats sites[MAX_SITES]; // Open addressing hash table of lock and call site pairs
+		std::atomic<int64> dropped;     // Acquisitions that found no free entry
+
+		LockProfiler() : dropped(0) {
+			memset((void*)sites, 0, sizeof(sites));
+		}
+
+		static LockProfiler& get(void) {
+			static LockProfiler profiler;
+			return profiler;
+		}
+
+		static void updateMax(std::atomic<int64>& max, int64 value) {
+			int64 cur = max.load(std::memory_order_relaxed);
+			while (value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {}
+		}
+
+		template <class Row>
+		static void printRow(FILE* out, const char* title, const Row& r) {
+			fprintf(out, "%-40s %10lld %10lld %7.2f %11.3f %11.1f %11.3f %11.1f\n", title, (long long)r.acquisitions,
+				(long long)r.contended, 100.0 * r.contended / r.acquisitions, r.waitNs / 1e6, r.maxWaitNs / 1e3,
+				r.holdNs / 1e6, r.maxHoldNs / 1e3);
+		}
+	};
+
+}//namespace a7az0th
+
+#else
+
+namespace a7az0th {
+	// Stands in for the lock profiler when it is compiled out, so reporting code does not need its own #ifdefs
+	class LockProfiler {
+	public:
+		static void report(FILE* = stdout, int = 20) {}
+		static void reset(void) {}
+	};
+}//namespace a7az0th
+
+#endif
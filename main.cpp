@@ -1,4 +1,5 @@
 #include "stdio.h"
+#include <cstring>
 
 #include "threadman.h"
 #include "timer.h"
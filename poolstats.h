@@ -0,0 +1,184 @@
+#pragma once
+
+// Layout of the shared-memory segment a ThreadManager publishes its statistics to (see ThreadManager::publishStats),
+// and the functions to create, attach to and read it. threadman-top is a reader.
+//
+// Each worker owns its slot and updates it under a sequence lock: the sequence is odd while an update is in progress,
+// so a reader copies the slot and retries if the sequence was odd or changed during the copy.
+// The segment is POSIX shared memory and only available on Linux.
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+#include "timer.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace a7az0th {
+
+	// What a worker is doing, as seen by the stats segment
+	enum PoolWorkerState {
+		POOL_WORKER_NONE = 0, // The slot is not used
+		POOL_WORKER_PARKED,   // Blocked, waiting to be woken
+		POOL_WORKER_IDLE,     // Awake without a job, e.g. busy-polling
+		POOL_WORKER_RUNNING,  // Executing a job
+	};
+
+	// Number of buckets of the histograms. Bucket b counts durations in [2^b, 2^(b+1)) ns
+	const int POOL_STATS_BUCKETS = 40;
+	// Number of workers the segment has room for
+	const int POOL_STATS_MAX_WORKERS = 64;
+	// How many characters of a region name are kept
+	const int POOL_STATS_NAME_SIZE = 64;
+
+	// Statistics of a single worker
+	struct PoolWorkerStats {
+		std::atomic<unsigned> sequence; // Odd while the worker is updating the fields below
+		int state;                      // One of PoolWorkerState
+		int tid;                        // OS id of the worker
+		int64 stateSince;               // When the worker entered its state, in ns of the monotonic clock
+		int64 jobs;                     // Number of job indices executed
+		int64 busyNs;                   // Total time spent executing jobs
+		int64 wakeNs;                   // Total time from dispatch until the worker started executing
+		char region[POOL_STATS_NAME_SIZE];         // Name of the region last executed
+		int64 jobHistogram[POOL_STATS_BUCKETS];    // How long job indices took
+		int64 wakeHistogram[POOL_STATS_BUCKETS];   // How long it took from dispatch until the worker started
+	};
+
+	// The whole segment
+	struct PoolStats {
+		static const unsigned MAGIC = 0x7468726d; // "thrm"
+		static const unsigned VERSION = 1;
+
+		unsigned magic;                 // MAGIC once the segment is initialized
+		unsigned version;               // VERSION of the layout
+		int pid;                        // Process that owns the pool
+		std::atomic<int> numWorkers;    // Number of used worker slots
+		std::atomic<int64> runs;        // Number of ThreadManager::run calls
+		std::atomic<int64> inlineJobs;  // Job indices the callers executed because the pool was exhausted
+		PoolWorkerStats workers[POOL_STATS_MAX_WORKERS];
+	};
+
+	// Returns the histogram bucket of a duration
+	inline int getStatsBucket(int64 ns) {
+		int b = 0;
+		while (ns > 1 && b < POOL_STATS_BUCKETS - 1) {
+			ns >>= 1;
+			b++;
+		}
+		return b;
+	}
+
+	// Writer side of a worker slot. Only the worker owning the slot may use it.
+	struct PoolWorkerStatsWriter {
+		explicit PoolWorkerStatsWriter(PoolWorkerStats& stats) : stats(stats) {
+			const unsigned seq = stats.sequence.load(std::memory_order_relaxed);
+			stats.sequence.store(seq + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+		~PoolWorkerStatsWriter() {
+			stats.sequence.store(stats.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+	private:
+		PoolWorkerStats& stats;
+	};
+
+	// Takes a consistent copy of a worker slot
+	inline void readWorkerStats(const PoolWorkerStats& stats, PoolWorkerStats& res) {
+		for (;;) {
+			const unsigned before = stats.sequence.load(std::memory_order_acquire);
+			if (before & 1) {
+				continue;
+			}
+			memcpy((void*)&res, (const void*)&stats, sizeof(res));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (stats.sequence.load(std::memory_order_relaxed) == before) {
+				res.region[POOL_STATS_NAME_SIZE - 1] = 0;
+				return;
+			}
+		}
+	}
+
+	// Returns the default segment name for a process
+	inline void getStatsSegmentName(int pid, char* name, size_t size) {
+		snprintf(name, size, "/threadman-%d", pid);
+	}
+
+	// Returns the default segment name for the calling process
+	inline void getStatsSegmentName(char* name, size_t size) {
+#ifdef __linux__
+		getStatsSegmentName(getpid(), name, size);
+#else
+		getStatsSegmentName(0, name, size);
+#endif
+	}
+
+	// Creates and initializes a segment. Returns NULL on failure
+	inline PoolStats* createStatsSegment(const char* name) {
+#ifdef __linux__
+		const int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+		if (fd < 0) return NULL;
+		void* mem = MAP_FAILED;
+		if (0 == ftruncate(fd, sizeof(PoolStats))) {
+			mem = mmap(NULL, sizeof(PoolStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (mem == MAP_FAILED) {
+			shm_unlink(name);
+			return NULL;
+		}
+		// ftruncate zero-fills, which is a valid initial state for all fields
+		PoolStats* stats = static_cast<PoolStats*>(mem);
+		stats->pid = getpid();
+		stats->version = PoolStats::VERSION;
+		std::atomic_thread_fence(std::memory_order_release);
+		stats->magic = PoolStats::MAGIC;
+		return stats;
+#else
+		(void)name;
+		return NULL;
+#endif
+	}
+
+	// Attaches to a segment created by another process for reading. Returns NULL if it does not exist or does not match
+	inline const PoolStats* openStatsSegment(const char* name) {
+#ifdef __linux__
+		const int fd = shm_open(name, O_RDONLY, 0);
+		if (fd < 0) return NULL;
+		struct stat st;
+		void* mem = MAP_FAILED;
+		if (0 == fstat(fd, &st) && size_t(st.st_size) >= sizeof(PoolStats)) {
+			mem = mmap(NULL, sizeof(PoolStats), PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (mem == MAP_FAILED) return NULL;
+		const PoolStats* stats = static_cast<const PoolStats*>(mem);
+		if (stats->magic != PoolStats::MAGIC || stats->version != PoolStats::VERSION) {
+			munmap(mem, sizeof(PoolStats));
+			return NULL;
+		}
+		return stats;
+#else
+		(void)name;
+		return NULL;
+#endif
+	}
+
+	// Unmaps a segment. If name is given the segment is also removed
+	inline void closeStatsSegment(const PoolStats* stats, const char* name) {
+#ifdef __linux__
+		if (stats) munmap((void*)stats, sizeof(PoolStats));
+		if (name) shm_unlink(name);
+#else
+		(void)stats;
+		(void)name;
+#endif
+	}
+
+}//namespace a7az0th
@@ -0,0 +1,313 @@
+#pragma once
+
+// Named profiling zones. Put PROFILE_ZONE("name") at the start of a scope, e.g. inside threadProc or body,
+// and the time until the end of the scope is recorded for that zone, separately for every thread.
+// Profiler::report prints inclusive and exclusive time, call counts and how the time is spread over the threads.
+//
+// Zones are only compiled in if THREADMAN_PROFILING is defined. Otherwise PROFILE_ZONE expands to nothing.
+
+#ifdef THREADMAN_PROFILING
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "threadman.h"
+#include "timer.h"
+
+namespace a7az0th {
+
+	// Per-thread profiling data. Only the owning thread writes it, so plain loads and stores are enough,
+	// the atomics are there so that a report can be taken while the threads keep running.
+	struct ProfileThreadData {
+		// How many zones there can be in a program
+		static const int MAX_ZONES = 256;
+		// How deep zones can be nested. Deeper zones are not recorded
+		static const int MAX_DEPTH = 64;
+
+		std::atomic<int64> calls[MAX_ZONES];     // Number of times each zone was entered
+		std::atomic<int64> inclusive[MAX_ZONES]; // Total time spent in each zone, in ns
+		std::atomic<int64> exclusive[MAX_ZONES]; // Time spent in each zone minus the time in nested zones, in ns
+		int64 childTime[MAX_DEPTH];              // Time spent in nested zones, for every open zone
+		int depth;                               // Number of currently open zones
+		int workerSlot;                          // Slot of the thread in its ThreadManager, -1 if not a worker
+
+		ProfileThreadData() : depth(0), workerSlot(currentWorkerSlot()) {
+			for (int i = 0; i < MAX_ZONES; i++) {
+				calls[i] = inclusive[i] = exclusive[i] = 0;
+			}
+		}
+	};
+
+	class Profiler {
+	public:
+		// How many threads can record at the same time. Further threads are ignored.
+		// The slot of a thread is recycled when it exits, and its times are added to the exited threads total.
+		static const int MAX_THREADS = 256;
+
+		// Registers a zone and returns its id. Called once per zone, from the static initializer of PROFILE_ZONE.
+		static int registerZone(const char* name) {
+			Profiler& p = get();
+			MutexRAII lock(p.mutex);
+			if (int(p.zoneNames.size()) >= ProfileThreadData::MAX_ZONES) {
+				return -1;
+			}
+			p.zoneNames.push_back(name);
+			return int(p.zoneNames.size()) - 1;
+		}
+
+		// Returns the data of the calling thread, creating it on first use. NULL if there are too many threads.
+		static ProfileThreadData* getThreadData(void) {
+			static thread_local ThreadSlot slot;
+			if (!slot.registered) {
+				slot.registered = true;
+				slot.index = get().acquire();
+				if (slot.index >= 0) {
+					slot.data = get().threads[slot.index];
+				}
+			}
+			return slot.data;
+		}
+
+		// Prints a table of all zones sorted by inclusive time
+		static void report(FILE* out = stdout) {
+			Profiler& p = get();
+			std::vector<const char*> names;
+			{
+				MutexRAII lock(p.mutex);
+				names = p.zoneNames;
+			}
+			const int numThreads = std::min(int(p.numThreads), int(MAX_THREADS));
+
+			struct Row {
+				int zone;
+				int64 calls, inclusive, exclusive;
+				int64 minThread, maxThread; // Smallest and largest inclusive time of a single thread that entered the zone
+				int threads;                // Number of threads that entered the zone
+			};
+			std::vector<Row> rows;
+			for (int z = 0; z < int(names.size()); z++) {
+				Row row = { z, 0, 0, 0, -1, 0, 0 };
+				// Exited threads count towards the totals, but not towards the spread over the threads
+				row.calls += p.exited.calls[z].load(std::memory_order_relaxed);
+				row.inclusive += p.exited.inclusive[z].load(std::memory_order_relaxed);
+				row.exclusive += p.exited.exclusive[z].load(std::memory_order_relaxed);
+				for (int t = 0; t < numThreads; t++) {
+					const ProfileThreadData* data = p.threads[t];
+					if (!data) continue;
+					const int64 calls = data->calls[z].load(std::memory_order_relaxed);
+					if (calls == 0) continue;
+					const int64 inclusive = data->inclusive[z].load(std::memory_order_relaxed);
+					row.calls += calls;
+					row.inclusive += inclusive;
+					row.exclusive += data->exclusive[z].load(std::memory_order_relaxed);
+					row.minThread = (row.minThread < 0) ? inclusive : std::min(row.minThread, inclusive);
+					row.maxThread = std::max(row.maxThread, inclusive);
+					row.threads++;
+				}
+				if (row.minThread < 0) row.minThread = 0;
+				if (row.calls > 0) rows.push_back(row);
+			}
+			std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.inclusive > b.inclusive; });
+
+			fprintf(out, "%-24s %10s %12s %12s %10s %8s %12s %12s\n",
+				"zone", "calls", "incl ms", "excl ms", "avg us", "threads", "min thr ms", "max thr ms");
+			for (size_t i = 0; i < rows.size(); i++) {
+				const Row& r = rows[i];
+				fprintf(out, "%-24s %10lld %12.3f %12.3f %10.3f %8d %12.3f %12.3f\n", names[r.zone], r.calls,
+					r.inclusive / 1e6, r.exclusive / 1e6, r.inclusive / 1e3 / r.calls, r.threads,
+					r.minThread / 1e6, r.maxThread / 1e6);
+			}
+		}
+
+		// Prints the inclusive time of a zone for every thread that entered it
+		static void reportZone(const char* name, FILE* out = stdout) {
+			Profiler& p = get();
+			int zone = -1;
+			{
+				MutexRAII lock(p.mutex);
+				for (size_t z = 0; z < p.zoneNames.size(); z++) {
+					if (0 == strcmp(p.zoneNames[z], name)) zone = int(z);
+				}
+			}
+			if (zone < 0) return;
+			const int numThreads = std::min(int(p.numThreads), int(MAX_THREADS));
+			fprintf(out, "%s\n", name);
+			for (int t = 0; t < numThreads; t++) {
+				const ProfileThreadData* data = p.threads[t];
+				if (!data || data->calls[zone] == 0) continue;
+				if (data->workerSlot >= 0) {
+					fprintf(out, "  worker %-6d", data->workerSlot);
+				} else {
+					fprintf(out, "  thread %-6d", t);
+				}
+				printZoneTimes(out, *data, zone);
+			}
+			if (p.exited.calls[zone] != 0) {
+				fprintf(out, "  %-13s", "exited");
+				printZoneTimes(out, p.exited, zone);
+			}
+		}
+
+		// Clears all recorded times. Zones that are open at the moment still record when they close,
+		// and a zone closing during the reset may keep its old totals.
+		static void reset(void) {
+			Profiler& p = get();
+			const int numThreads = std::min(int(p.numThreads), int(MAX_THREADS));
+			for (int t = 0; t < numThreads; t++) {
+				ProfileThreadData* data = p.threads[t];
+				if (!data) continue;
+				for (int z = 0; z < ProfileThreadData::MAX_ZONES; z++) {
+					data->calls[z] = data->inclusive[z] = data->exclusive[z] = 0;
+				}
+			}
+			MutexRAII lock(p.mutex);
+			for (int z = 0; z < ProfileThreadData::MAX_ZONES; z++) {
+				p.exited.calls[z] = p.exited.inclusive[z] = p.exited.exclusive[z] = 0;
+			}
+		}
+
+	private:
+		// Gives the slot of a thread back when it exits
+		struct ThreadSlot {
+			bool registered;
+			int index;               // -1 if the thread got no slot
+			ProfileThreadData* data;
+			ThreadSlot() : registered(false), index(-1), data(NULL) {}
+			~ThreadSlot() {
+				if (index >= 0) get().release(index);
+			}
+		};
+
+		Mutex mutex;                            // Guards zoneNames and the writes to exited
+		std::vector<const char*> zoneNames;     // Indexed by zone id
+		std::atomic<int> numThreads;            // Number of slots ever used. Reports look at these
+		std::atomic<ProfileThreadData*> threads[MAX_THREADS]; // Never freed, a report may be reading them
+		std::atomic<bool> used[MAX_THREADS];    // The slot belongs to a live thread
+		ProfileThreadData exited;               // Totals of the threads that have exited
+
+		Profiler() : numThreads(0) {
+			mutex.setName("Profiler");
+			for (int i = 0; i < MAX_THREADS; i++) {
+				threads[i] = NULL;
+				used[i] = false;
+			}
+			exited.workerSlot = -1;
+		}
+
+		// Never destroyed: threads of a global ThreadManager give back their slots after static destructors have run
+		static Profiler& get(void) {
+			static Profiler* profiler = new Profiler;
+			return *profiler;
+		}
+
+		// Claims a free slot for the calling thread. Returns -1 if all are taken
+		int acquire(void) {
+			for (int i = 0; i < MAX_THREADS; i++) {
+				bool expected = false;
+				if (used[i].load(std::memory_order_relaxed) || !used[i].compare_exchange_strong(expected, true)) continue;
+				if (!threads[i]) {
+					threads[i] = new ProfileThreadData;
+				}
+				ProfileThreadData* data = threads[i];
+				data->depth = 0;
+				data->workerSlot = currentWorkerSlot();
+				int n = numThreads.load(std::memory_order_relaxed);
+				while (n < i + 1 && !numThreads.compare_exchange_weak(n, i + 1)) {}
+				return i;
+			}
+			return -1;
+		}
+
+		// Moves the times of an exiting thread to the exited totals and frees its slot.
+		// A report taken meanwhile may count them twice.
+		void release(int index) {
+			ProfileThreadData* data = threads[index];
+			{
+				MutexRAII lock(mutex);
+				for (int z = 0; z < ProfileThreadData::MAX_ZONES; z++) {
+					exited.calls[z] = exited.calls[z] + data->calls[z];
+					exited.inclusive[z] = exited.inclusive[z] + data->inclusive[z];
+					exited.exclusive[z] = exited.exclusive[z] + data->exclusive[z];
+				}
+			}
+			for (int z = 0; z < ProfileThreadData::MAX_ZONES; z++) {
+				data->calls[z] = data->inclusive[z] = data->exclusive[z] = 0;
+			}
+			used[index].store(false, std::memory_order_release);
+		}
+
+		static void printZoneTimes(FILE* out, const ProfileThreadData& data, int zone) {
+			fprintf(out, " %10lld calls %12.3f ms incl %12.3f ms excl\n", (long long)data.calls[zone],
+				data.inclusive[zone] / 1e6, data.exclusive[zone] / 1e6);
+		}
+	};
+
+	// Static description of a zone. One per PROFILE_ZONE, created the first time the zone is entered.
+	struct ProfileZoneInfo {
+		int id;
+		explicit ProfileZoneInfo(const char* name) : id(Profiler::registerZone(name)) {}
+	};
+
+	// Records the time from its construction to its destruction in the zone given
+	class ProfileZone {
+	public:
+		explicit ProfileZone(const ProfileZoneInfo& info) : zone(info.id), data(Profiler::getThreadData()) {
+			if (!data || zone < 0 || data->depth >= ProfileThreadData::MAX_DEPTH) {
+				data = NULL;
+				return;
+			}
+			data->childTime[data->depth++] = 0;
+			start = getTimeNs();
+		}
+
+		~ProfileZone() {
+			if (!data) return;
+			const int64 elapsed = getTimeNs() - start;
+			const int depth = --data->depth;
+			const int64 exclusive = elapsed - data->childTime[depth];
+			if (depth > 0) {
+				data->childTime[depth - 1] += elapsed;
+			}
+			// Single writer - no need for read-modify-write instructions
+			data->calls[zone].store(data->calls[zone].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			data->inclusive[zone].store(data->inclusive[zone].load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+			data->exclusive[zone].store(data->exclusive[zone].load(std::memory_order_relaxed) + exclusive, std::memory_order_relaxed);
+		}
+
+	private:
+		int zone;
+		ProfileThreadData* data;
+		int64 start;
+
+		ProfileZone(const ProfileZone&) = delete;
+		ProfileZone& operator=(const ProfileZone&) = delete;
+	};
+
+}//namespace a7az0th
+
+#define PROFILE_ZONE_CONCAT2(a, b) a##b
+#define PROFILE_ZONE_CONCAT(a, b) PROFILE_ZONE_CONCAT2(a, b)
+#define PROFILE_ZONE(name) \
+	static const a7az0th::ProfileZoneInfo PROFILE_ZONE_CONCAT(profileZoneInfo, __LINE__)(name); \
+	a7az0th::ProfileZone PROFILE_ZONE_CONCAT(profileZone, __LINE__)(PROFILE_ZONE_CONCAT(profileZoneInfo, __LINE__))
+
+#else
+
+#include <stdio.h>
+
+namespace a7az0th {
+	// Stands in for the profiler when it is compiled out, so reporting code does not need its own #ifdefs
+	class Profiler {
+	public:
+		static void report(FILE* = stdout) {}
+		static void reportZone(const char*, FILE* = stdout) {}
+		static void reset(void) {}
+	};
+}//namespace a7az0th
+
+#define PROFILE_ZONE(name)
+
+#endif
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include "threadman.h"
+
+#ifdef __linux__
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+namespace a7az0th {
+
+	// A low rate sampling profiler for the workers of a ThreadManager.
+	// Every worker gets a timer on its own CPU-time clock, so samples are only taken while it actually runs.
+	// Each sample captures the stack and the region the worker is executing, and dumpFolded writes them in
+	// the folded format flame graph tools read. Regions are only tracked by pools whose policy has STATS, with other
+	// policies every sample goes under (idle). Names are resolved from the dynamic symbol table, so link with
+	// -rdynamic for useful stacks.
+	// Only available on Linux. Elsewhere start() returns false.
+	class Sampler {
+	public:
+		// How many frames of a stack are kept
+		static const int MAX_FRAMES = 48;
+
+		// @param samplesPerWorker How many samples a worker can hold before further ones are dropped
+		explicit Sampler(int samplesPerWorker = 16384) : capacity(samplesPerWorker), running(false) {}
+		~Sampler() { stop(); }
+
+		// Starts sampling all workers currently in the pool. Workers spawned later are not sampled,
+		// so call ThreadManager::warmup first.
+		// @param threadman The pool to sample
+		// @param hz Samples per second of CPU time of each worker
+		// @returns false if sampling is not supported or a timer could not be created
+		template <class Policy>
+		bool start(ThreadManagerT<Policy>& threadman, int hz = 99) {
+#ifdef __linux__
+			if (running) return false;
+			// backtrace() may allocate the first time it is called, which is not safe from a signal handler
+			void* frames[4];
+			backtrace(frames, 4);
+
+			struct sigaction sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_sigaction = &onSignal;
+			sa.sa_flags = SA_SIGINFO | SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			if (0 != sigaction(SIGPROF, &sa, &oldAction)) return false;
+
+			const int numWorkers = threadman.getThreadCount();
+			workers.resize(numWorkers);
+			for (int i = 0; i < numWorkers; i++) {
+				Worker& w = workers[i];
+				w.slot = i;
+				w.samples.resize(capacity);
+				w.count = 0;
+				w.dropped = 0;
+				w.hasTimer = false;
+
+				clockid_t clock;
+				const int tid = threadman.getWorkerTid(i);
+				if (tid == 0 || 0 != pthread_getcpuclockid(threadman.getWorkerHandle(i), &clock)) continue;
+
+				sigevent sev;
+				memset(&sev, 0, sizeof(sev));
+				sev.sigev_notify = SIGEV_THREAD_ID;
+				sev.sigev_signo = SIGPROF;
+				sev.sigev_notify_thread_id = tid;
+				sev.sigev_value.sival_ptr = &w;
+				if (0 != timer_create(clock, &sev, &w.timer)) continue;
+				w.hasTimer = true;
+
+				itimerspec spec;
+				const long periodNs = 1000000000L / (hz > 0 ? hz : 1);
+				spec.it_interval.tv_sec = periodNs / 1000000000L;
+				spec.it_interval.tv_nsec = periodNs % 1000000000L;
+				spec.it_value = spec.it_interval;
+				timer_settime(w.timer, 0, &spec, NULL);
+			}
+			running = true;
+			return true;
+#else
+			(void)threadman;
+			(void)hz;
+			return false;
+#endif
+		}
+
+		// Stops sampling. The samples taken are kept until the next start().
+		void stop(void) {
+#ifdef __linux__
+			if (!running) return;
+			for (size_t i = 0; i < workers.size(); i++) {
+				if (workers[i].hasTimer) {
+					timer_delete(workers[i].timer);
+					workers[i].hasTimer = false;
+				}
+			}
+			// Deleting a timer also drops its signal if still pending, so the handler the application had can come back
+			sigaction(SIGPROF, &oldAction, NULL);
+			running = false;
+#endif
+		}
+
+		// Writes the samples as folded stacks - "region;outer frame;...;inner frame count" per line.
+		// Must be called after stop().
+		// @param perWorker Put the worker slot under the region, to see how samples are spread over the workers
+		void dumpFolded(FILE* out, bool perWorker = false) const {
+#ifdef __linux__
+			std::map<std::string, int> folded;
+			std::map<void*, std::string> symbols;
+			for (size_t i = 0; i < workers.size(); i++) {
+				const Worker& w = workers[i];
+				const int count = std::min(int(w.count), capacity);
+				for (int s = 0; s < count; s++) {
+					const Sample& sample = w.samples[s];
+					std::string line = demangle(sample.region ? sample.region : "(idle)");
+					if (perWorker) {
+						char buf[32];
+						snprintf(buf, sizeof(buf), ";worker %d", w.slot);
+						line += buf;
+					}
+					// Skip the signal handler and the trampoline that called it
+					for (int f = sample.depth - 1; f >= 2; f--) {
+						line += ";";
+						line += symbolize(sample.frames[f], symbols);
+					}
+					folded[line]++;
+				}
+			}
+			for (std::map<std::string, int>::const_iterator it = folded.begin(); it != folded.end(); ++it) {
+				fprintf(out, "%s %d\n", it->first.c_str(), it->second);
+			}
+#else
+			(void)out;
+			(void)perWorker;
+#endif
+		}
+
+		// Returns the number of samples taken and how many were dropped because the buffers were full
+		void getCounts(long long& taken, long long& dropped) const {
+			taken = dropped = 0;
+			for (size_t i = 0; i < workers.size(); i++) {
+				taken += std::min(int(workers[i].count), capacity);
+				dropped += workers[i].dropped;
+			}
+		}
+
+	private:
+		struct Sample {
+			const char* region;        // The region the worker was executing, NULL if it was idle
+			int depth;                 // Number of valid frames
+			void* frames[MAX_FRAMES];  // Return addresses, innermost first
+		};
+
+		struct Worker {
+			int slot;                   // Slot of the worker in the pool
+			std::vector<Sample> samples; // Filled only by the signal handler of this worker
+			std::atomic<int> count;     // Samples taken so far
+			std::atomic<int> dropped;   // Samples that did not fit
+#ifdef __linux__
+			timer_t timer;
+#endif
+			bool hasTimer;
+
+			Worker() : slot(0), count(0), dropped(0), hasTimer(false) {}
+			Worker(const Worker& rhs) : slot(rhs.slot), samples(rhs.samples), count(int(rhs.count)), dropped(int(rhs.dropped)), hasTimer(false) {}
+		};
+
+		int capacity;                // Samples per worker
+		bool running;                // Between start() and stop()
+		std::vector<Worker> workers; // Indexed by worker slot
+#ifdef __linux__
+		struct sigaction oldAction;  // The SIGPROF handler before start(), restored by stop()
+
+		// Runs on the worker that was sampled. Only async-signal-safe work here.
+		// The signal may interrupt a libc call whose errno the worker is about to read, so it is preserved.
+		static void onSignal(int, siginfo_t* si, void*) {
+			const int savedErrno = errno;
+			Worker* w = static_cast<Worker*>(si->si_value.sival_ptr);
+			if (!w || si->si_code != SI_TIMER) {
+				errno = savedErrno;
+				return;
+			}
+			const int index = w->count.load(std::memory_order_relaxed);
+			if (index >= int(w->samples.size())) {
+				w->dropped.fetch_add(1, std::memory_order_relaxed);
+				errno = savedErrno;
+				return;
+			}
+			Sample& sample = w->samples[index];
+			sample.region = currentRegionName();
+			sample.depth = backtrace(sample.frames, MAX_FRAMES);
+			w->count.store(index + 1, std::memory_order_release);
+			errno = savedErrno;
+		}
+
+		static std::string demangle(const char* name) {
+			int status = 0;
+			char* res = abi::__cxa_demangle(name, NULL, NULL, &status);
+			if (status != 0 || !res) return name;
+			std::string str(res);
+			free(res);
+			return str;
+		}
+
+		// Returns the function name for an address, or the name of the binary if it has no symbol
+		static std::string symbolize(void* addr, std::map<void*, std::string>& cache) {
+			std::map<void*, std::string>::iterator it = cache.find(addr);
+			if (it != cache.end()) return it->second;
+
+			std::string res;
+			char** symbols = backtrace_symbols(&addr, 1);
+			if (symbols) {
+				// The format is "binary(function+0x1f) [0x4005d4]"
+				const std::string str(symbols[0]);
+				free(symbols);
+				const size_t open = str.find('(');
+				const size_t plus = str.find('+', open);
+				if (open != std::string::npos && plus != std::string::npos && plus > open + 1) {
+					res = demangle(str.substr(open + 1, plus - open - 1).c_str());
+				} else {
+					const size_t slash = str.rfind('/', open);
+					res = str.substr(slash == std::string::npos ? 0 : slash + 1, open == std::string::npos ? std::string::npos : open - slash - 1);
+				}
+			}
+			if (res.empty()) {
+				char buf[32];
+				snprintf(buf, sizeof(buf), "%p", addr);
+				res = buf;
+			}
+			// Semicolons separate frames in the folded format
+			for (size_t i = 0; i < res.size(); i++) {
+				if (res[i] == ';') res[i] = ':';
+			}
+			cache[addr] = res;
+			return res;
+		}
+#endif
+
+		Sampler(const Sampler&) = delete;
+		Sampler& operator=(const Sampler&) = delete;
+	};
+
+}//namespace a7az0th
@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <atomic>
+
+#include "threadman.h"
+#include "cache.h"
+
+// Looks up a few keys of a ConcurrentCache from many tasks at once, on both pool policies, and evicts through a
+// small budget. Every key must be computed once while it stays cached.
+
+using namespace a7az0th;
+
+static int fib(int n) {
+	return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+template <class Policy>
+static bool testCache(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	ConcurrentCache<int, int> cache(1 << 20);
+	std::atomic<int> computed(0);
+	std::atomic<long long> sum(0);
+	for (int i = 0; i < 256; i++) {
+		threadman.submit([&cache, &computed, &sum, &threadman, i]() {
+			const int key = i % 8;
+			sum += *cache.getOrCompute(key, [&computed, key]() { computed++; return fib(15 + key); }, threadman);
+		});
+	}
+	threadman.waitForTasks();
+	long long expected = 0;
+	for (int i = 0; i < 256; i++) {
+		expected += fib(15 + i % 8);
+	}
+	const CacheStats stats = cache.getStats();
+
+	// Room for a few values per shard only, so most of them get evicted again
+	ConcurrentCache<int, int> small(4 * 4 * (sizeof(int) + sizeof(int)), 4);
+	bool values = true;
+	for (int i = 0; i < 1000; i++) {
+		values = values && *small.getOrCompute(i % 100, [i]() { return i % 100; }) == i % 100;
+	}
+	small.erase(7);
+	small.clear();
+	const CacheStats smallStats = small.getStats();
+
+	printf("%s: computed %d, hits %lld, waits %lld, evictions %lld\n", name, int(computed), stats.hits, stats.waits, smallStats.evictions);
+	return sum == expected && computed == 8 && values && smallStats.evictions > 0 && smallStats.entries == 0;
+}
+
+int main() {
+	bool ok = testCache<DefaultPolicy>("ThreadManager");
+	ok = testCache<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
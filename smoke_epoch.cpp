@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <atomic>
+
+#include "threadman.h"
+#include "epoch.h"
+
+// Pushes and pops a LockFreeStack from the workers of both pool policies, and checks every element comes out once
+
+using namespace a7az0th;
+
+template <class Policy>
+static bool testStack(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	LockFreeStack<int> stack;
+	std::atomic<long long> popped(0);
+	for (int t = 0; t < 8; t++) {
+		threadman.submit([&stack, &popped, t]() {
+			for (int i = 0; i < 1000; i++) {
+				stack.push(t * 1000 + i);
+				int v;
+				if (stack.pop(v)) popped += v;
+			}
+		});
+	}
+	threadman.waitForTasks();
+	int v;
+	while (stack.pop(v)) {
+		popped += v;
+	}
+	EpochReclaimer::synchronize();
+	const long long expected = 8000LL * 7999 / 2;
+	printf("%s: popped sum %lld, expected %lld, epoch %lld\n", name, (long long)popped, expected, EpochReclaimer::getEpoch());
+	return popped == expected && stack.empty();
+}
+
+int main() {
+	bool ok = testStack<DefaultPolicy>("ThreadManager");
+	ok = testStack<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <vector>
+
+#include "threadman.h"
+#include "future.h"
+
+// Runs async, then, whenAll and whenAny on both pool policies
+
+using namespace a7az0th;
+
+static int fib(int n) {
+	return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+template <class Policy>
+static bool testFutures(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	std::vector<Future<int>> parts;
+	for (int i = 0; i < 16; i++) {
+		parts.push_back(async(threadman, [i]() { return fib(10 + i % 4); }).then([](int v) { return v + 1; }));
+	}
+	int sum = 0;
+	const std::vector<Future<int>> all = whenAll(parts).get();
+	for (size_t i = 0; i < all.size(); i++) {
+		sum += all[i].get();
+	}
+	const size_t first = whenAny(parts).get();
+	int expected = 0;
+	for (int i = 0; i < 16; i++) {
+		expected += fib(10 + i % 4) + 1;
+	}
+
+	// Nothing to wait for - ready at once, and a continuation still runs
+	Future<std::vector<Future<int>>> none = whenAll(std::vector<Future<int>>());
+	const size_t noneCount = none.then([](std::vector<Future<int>>& v) { return v.size(); }).get();
+
+	printf("%s: sum %d, expected %d, first %d, empty ready %d\n", name, sum, expected, int(first), none.isReady());
+	return sum == expected && first < parts.size() && none.isReady() && noneCount == 0;
+}
+
+int main() {
+	bool ok = testFutures<DefaultPolicy>("ThreadManager");
+	ok = testFutures<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
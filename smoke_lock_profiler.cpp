@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "threadman.h"
+#include "lockprofiler.h"
+
+// Increments a counter under a named Mutex from the workers of both pool policies and checks the lock shows up in
+// the report. Built plain and with THREADMAN_LOCK_PROFILING - without it the report must stay empty.
+
+using namespace a7az0th;
+
+struct Counter : MultiThreadedFor {
+	Mutex lock;
+	long long total;
+	Counter() : total(0) { lock.setName("smoke counter"); }
+	void body(int index, int, int) override {
+		MutexRAII guard(lock);
+		total += index;
+	}
+};
+
+// Returns whether the report of the lock profiler mentions the lock
+static bool reported(const char* lockName) {
+	FILE* out = tmpfile();
+	if (!out) return false;
+	LockProfiler::report(out);
+	rewind(out);
+	char line[256];
+	bool found = false;
+	while (fgets(line, sizeof(line), out)) {
+		found = found || strstr(line, lockName) != NULL;
+	}
+	fclose(out);
+	return found;
+}
+
+template <class Policy>
+static bool testLocks(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	Counter counter;
+	counter.run(threadman, 10000, 4);
+#ifdef THREADMAN_LOCK_PROFILING
+	const bool expected = true;
+#else
+	const bool expected = false;
+#endif
+	const bool found = reported("smoke counter");
+	printf("%s: total %lld, lock %s\n", name, counter.total, found ? "reported" : "not reported");
+	LockProfiler::reset();
+	return counter.total == 9999LL * 10000 / 2 && found == expected;
+}
+
+int main() {
+	bool ok = testLocks<DefaultPolicy>("ThreadManager");
+	ok = testLocks<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "threadman.h"
+#include "profiler.h"
+
+// Runs a loop with a profiling zone on both pool policies and checks the zone shows up in the report.
+// Built plain and with THREADMAN_PROFILING - without it the zone and the report must compile to nothing.
+
+using namespace a7az0th;
+
+struct Squares : MultiThreadedFor {
+	std::vector<long long> res;
+	explicit Squares(int n) : res(n) {}
+	void body(int index, int, int) override {
+		PROFILE_ZONE("Squares::body");
+		res[index] = (long long)index * index;
+	}
+};
+
+// Returns whether the report of the profiler mentions the zone
+static bool reported(const char* zone) {
+	FILE* out = tmpfile();
+	if (!out) return false;
+	Profiler::report(out);
+	rewind(out);
+	char line[256];
+	bool found = false;
+	while (fgets(line, sizeof(line), out)) {
+		found = found || strstr(line, zone) != NULL;
+	}
+	fclose(out);
+	return found;
+}
+
+template <class Policy>
+static bool testZones(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	Squares loop(100000);
+	loop.run(threadman, 100000, 4);
+	bool ok = true;
+	for (int i = 0; i < 100000; i++) {
+		ok = ok && loop.res[i] == (long long)i * i;
+	}
+#ifdef THREADMAN_PROFILING
+	const bool expected = true;
+#else
+	const bool expected = false;
+#endif
+	const bool found = reported("Squares::body");
+	printf("%s: loop %s, zone %s\n", name, ok ? "ok" : "wrong", found ? "reported" : "not reported");
+	Profiler::reset();
+	return ok && found == expected;
+}
+
+int main() {
+	bool ok = testZones<DefaultPolicy>("ThreadManager");
+	ok = testZones<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
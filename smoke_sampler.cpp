@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <atomic>
+
+#include "threadman.h"
+#include "timer.h"
+#include "sampler.h"
+
+// Samples a job that keeps every worker busy, on both pool policies, and checks that samples were taken
+
+using namespace a7az0th;
+
+// Every index burns some CPU time, so that a timer on the CPU clock of its worker fires several times
+struct Burn : MultiThreaded {
+	std::atomic<long long> sink;
+	Burn() : sink(0) {}
+	void threadProc(int, int) override {
+		const int64 end = getTimeNs() + 50 * 1000000;
+		long long x = 0;
+		while (getTimeNs() < end) {
+			for (int i = 0; i < 1000; i++) x += i ^ x;
+		}
+		sink += x;
+	}
+};
+
+template <class Policy>
+static bool testSampler(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	threadman.warmup();
+	Sampler sampler;
+	const bool sampling = sampler.start(threadman, 997);
+	Burn job;
+	job.setName("Burn");
+	// One index more than there are workers, so every worker gets one - THREADS_AUTO may keep a cheap job
+	// on the calling thread, which is never sampled
+	job.run(threadman, threadman.getThreadCount() + 1);
+	sampler.stop();
+	long long taken, dropped;
+	sampler.getCounts(taken, dropped);
+	printf("%s: sampling %d, samples %lld, dropped %lld\n", name, sampling, taken, dropped);
+	// start() fails where sampling is not supported, there is nothing to check then
+	return !sampling || taken > 0;
+}
+
+int main() {
+	bool ok = testSampler<DefaultPolicy>("ThreadManager");
+	ok = testSampler<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
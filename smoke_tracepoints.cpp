@@ -0,0 +1,46 @@
+#include <stdio.h>
+
+#include "threadman.h"
+
+// Built against the stub <sys/sdt.h> in sdt_stub, which counts probe hits. Checks that the probes of both pool
+// policies stay quiet while their semaphores are zero, and fire once a tracer would have raised them
+
+using namespace a7az0th;
+
+struct Sum : MultiThreadedFor {
+	std::atomic<long long> total;
+	Sum() : total(0) {}
+	void body(int index, int, int) override { total += index; }
+};
+
+template <class Policy>
+static bool testProbes(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	Sum sum;
+	sdtStubHits() = 0;
+	sum.run(threadman, 1000, 4);
+	const int detached = sdtStubHits();
+
+	threadman_run_start_semaphore++;
+	threadman_chunk_claim_semaphore++;
+	sum.run(threadman, 1000, 4);
+	threadman_run_start_semaphore--;
+	threadman_chunk_claim_semaphore--;
+	const int attached = sdtStubHits() - detached;
+
+	// The low-latency pool has no TRACING, its probes are compiled out
+	printf("%s: %d hits detached, %d attached, sum %lld\n", name, detached, attached, (long long)sum.total);
+	return detached == 0 && (attached > 0) == bool(Policy::TRACING) && sum.total == 2 * 999LL * 1000 / 2;
+}
+
+int main() {
+#if !THREADMAN_HAS_TRACEPOINTS
+	printf("built without <sys/sdt.h>, nothing to check\n");
+	return 1;
+#else
+	bool ok = testProbes<DefaultPolicy>("ThreadManager");
+	ok = testProbes<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+#endif
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "threadman.h"
+#include "watchdog.h"
+
+// Stalls a single iteration of a loop on a worker and checks the StallDetector reports it, once while it runs and
+// once when it finishes. Chunks are only watched by pools with STATS, the low-latency pool must stay quiet.
+
+using namespace a7az0th;
+
+struct Stall : MultiThreadedFor {
+	std::atomic<int> stalledAt;
+	Stall() : stalledAt(-1) { setName("Stall"); }
+	void body(int index, int threadIdx, int) override {
+		// Index 0 of the job always runs on a pool worker, the calling thread only gets the last indices
+		int expected = -1;
+		if (threadIdx == 0 && stalledAt.compare_exchange_strong(expected, index)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		} else {
+			// Long enough that the calling thread does not finish the loop before the worker joins
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	}
+};
+
+template <class Policy>
+static bool testStalls(const char* name) {
+	ThreadManagerT<Policy> threadman;
+	std::mutex m;
+	std::vector<StallReport> reports;
+	Stall loop;
+	{
+		StallDetector detector(threadman, 100, [&m, &reports](const StallReport& r) {
+			std::lock_guard<std::mutex> lk(m);
+			reports.push_back(r);
+		});
+		loop.run(threadman, 64, 2);
+	}
+	bool detected = false, finished = false;
+	for (size_t i = 0; i < reports.size(); i++) {
+		const StallReport& r = reports[i];
+		const bool match = r.region && 0 == strcmp(r.region, "Stall") && r.begin == loop.stalledAt;
+		detected = detected || (match && !r.finished);
+		finished = finished || (match && r.finished && r.elapsedNs >= 300 * 1000000LL);
+	}
+	printf("%s: %d reports, stalled iteration %d %s\n", name, int(reports.size()), int(loop.stalledAt),
+		(detected && finished) ? "reported" : "not reported");
+	return Policy::STATS ? (detected && finished) : reports.empty();
+}
+
+int main() {
+	bool ok = testStalls<DefaultPolicy>("ThreadManager");
+	ok = testStalls<LowLatencyPolicy>("LowLatencyThreadManager") && ok;
+	printf("%s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
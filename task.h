@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <vector>
+
+namespace a7az0th {
+
+	// Size of a cache line. Task is sized to fill one by default
+	const size_t CACHE_LINE_SIZE = 64;
+
+	// A move-only callable taking no arguments, like a std::function<void()> that never copies.
+	// Callables of up to InlineSize bytes are stored inside the task, so wrapping a typical lambda does not allocate.
+	// Larger ones, or ones whose move constructor may throw, are moved to the heap.
+	// Unlike std::function it accepts move-only captures, e.g. a std::unique_ptr.
+	template <size_t InlineSize = CACHE_LINE_SIZE - sizeof(void*)>
+	class TaskT {
+	public:
+		TaskT() : ops(NULL) {}
+		~TaskT() { reset(); }
+
+		template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, TaskT>::value>::type>
+		TaskT(F&& f) : ops(NULL) {
+			assign(std::forward<F>(f));
+		}
+
+		TaskT(TaskT&& rhs) noexcept : ops(rhs.ops) {
+			if (ops) {
+				ops->move(storage, rhs.storage);
+				rhs.ops = NULL;
+			}
+		}
+
+		TaskT& operator=(TaskT&& rhs) noexcept {
+			if (this != &rhs) {
+				reset();
+				ops = rhs.ops;
+				if (ops) {
+					ops->move(storage, rhs.storage);
+					rhs.ops = NULL;
+				}
+			}
+			return *this;
+		}
+
+		// Calls the callable. The task must not be empty
+		void operator()(void) { ops->invoke(storage); }
+
+		// Whether the task holds a callable
+		explicit operator bool(void) const { return ops != NULL; }
+
+		// Destroys the callable, leaving the task empty
+		void reset(void) {
+			if (ops) {
+				ops->destroy(storage);
+				ops = NULL;
+			}
+		}
+
+		// Whether a callable of type F is stored without allocating
+		template <class F>
+		static constexpr bool isInline(void) {
+			return sizeof(F) <= InlineSize && alignof(F) <= alignof(Storage) && std::is_nothrow_move_constructible<F>::value;
+		}
+
+	private:
+		// What can be done with the stored callable. One static table per callable type
+		struct Ops {
+			void (*invoke)(void* storage);
+			void (*move)(void* dst, void* src); // Moves the callable to dst and destroys it in src
+			void (*destroy)(void* storage);
+		};
+
+		typedef typename std::aligned_storage<InlineSize, alignof(void*)>::type Storage;
+
+		Storage storage[1];
+		const Ops* ops; // NULL if empty
+
+		template <class F>
+		struct InlineOps {
+			static void invoke(void* s) { (*static_cast<F*>(s))(); }
+			static void move(void* dst, void* src) {
+				F* f = static_cast<F*>(src);
+				new (dst) F(std::move(*f));
+				f->~F();
+			}
+			static void destroy(void* s) { static_cast<F*>(s)->~F(); }
+			static const Ops* get(void) {
+				static const Ops ops = { &invoke, &move, &destroy };
+				return &ops;
+			}
+		};
+
+		template <class F>
+		struct HeapOps {
+			static void invoke(void* s) { (**static_cast<F**>(s))(); }
+			static void move(void* dst, void* src) { *static_cast<F**>(dst) = *static_cast<F**>(src); }
+			static void destroy(void* s) { delete *static_cast<F**>(s); }
+			static const Ops* get(void) {
+				static const Ops ops = { &invoke, &move, &destroy };
+				return &ops;
+			}
+		};
+
+		template <class F>
+		void assign(F&& f) {
+			typedef typename std::decay<F>::type Callable;
+			if (isInline<Callable>()) {
+				new (storage) Callable(std::forward<F>(f));
+				ops = InlineOps<Callable>::get();
+			} else {
+				*reinterpret_cast<Callable**>(storage) = new Callable(std::forward<F>(f));
+				ops = HeapOps<Callable>::get();
+			}
+		}
+
+		TaskT(const TaskT&) = delete;
+		TaskT& operator=(const TaskT&) = delete;
+	};
+
+	typedef TaskT<> Task;
+	static_assert(sizeof(Task) == CACHE_LINE_SIZE || sizeof(void*) != 8, "Task should fill a cache line");
+
+	// A FIFO of tasks in a ring buffer. Only allocates when it has to grow, so a queue that has reached its working
+	// size does no allocations at all. Not thread-safe.
+	template <class T>
+	class TaskRing {
+	public:
+		explicit TaskRing(size_t capacity = 64) : slots(roundUp(capacity)), head(0), count(0) {}
+
+		size_t size(void) const { return count; }
+		bool empty(void) const { return count == 0; }
+
+		// Makes room for at least n more tasks without reallocating
+		void reserve(size_t n) {
+			if (count + n <= slots.size()) return;
+			std::vector<T> grown(roundUp(count + n));
+			for (size_t i = 0; i < count; i++) {
+				grown[i] = std::move(slots[(head + i) & (slots.size() - 1)]);
+			}
+			slots.swap(grown);
+			head = 0;
+		}
+
+		void push(T&& task) {
+			reserve(1);
+			slots[(head + count) & (slots.size() - 1)] = std::move(task);
+			count++;
+		}
+
+		// Moves the oldest task to res. Returns false if the ring is empty
+		bool pop(T& res) {
+			if (count == 0) return false;
+			res = std::move(slots[head]);
+			head = (head + 1) & (slots.size() - 1);
+			count--;
+			return true;
+		}
+
+	private:
+		std::vector<T> slots; // Power of two sized
+		size_t head;          // Index of the oldest task
+		size_t count;         // Number of tasks
+
+		static size_t roundUp(size_t n) {
+			size_t res = 1;
+			while (res < n) res <<= 1;
+			return res;
+		}
+	};
+
+}//namespace a7az0th
@@ -4,13 +4,119 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <typeinfo>
+#include <iterator>
+#ifdef _MSC_VER
+#include <malloc.h>
+#define alloca _alloca
+#else
+#include <alloca.h>
+#endif
+
+#include "cpuinfo.h"
+#include "timer.h"
+#include "tracepoints.h"
+#include "poolstats.h"
+#include "lockprofiler.h"
+#include "task.h"
 
 namespace a7az0th {
 
 	// How many CPUs we support
 	const int MAX_CPU_COUNT = 64;
 
+	// Pass as the number of threads to MultiThreadedFor::run to let it pick how many workers to engage
+	const int THREADS_AUTO = -1;
+
+
+	// Tells the processor we are in a spin-wait loop. Saves power and frees resources for the sibling hyper-thread.
+	inline void cpuRelax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		asm volatile("yield" ::: "memory");
+#endif
+	}
+
+	// How many rounds a spin-wait pauses before it starts yielding the processor
+	const int SPIN_ROUNDS_BEFORE_YIELD = 1024;
+
+	// One round of a spin-wait. Start rounds at 0 for every wait. A wait that lasts gives up the processor every
+	// round, so that on an oversubscribed host the thread that would end it gets to run.
+	inline void spinWait(int& rounds) {
+		if (rounds < SPIN_ROUNDS_BEFORE_YIELD) {
+			rounds++;
+			cpuRelax();
+		} else {
+			std::this_thread::yield();
+		}
+	}
+
+	// Touches the given amount of stack below the caller, so that the pages are mapped before they are needed
+	inline void prefaultStack(size_t bytes) {
+		if (bytes == 0) return;
+		volatile char* stack = (volatile char*)alloca(bytes);
+		// Top down, the same order in which the stack grows
+		for (size_t i = bytes; i >= 4096; i -= 4096) {
+			stack[i - 1] = 0;
+		}
+		stack[0] = 0;
+	}
+
+	// Slot of the calling thread inside its ThreadManager pool, or -1 if the thread is not a pool worker
+	inline int& currentWorkerSlot(void) {
+		static thread_local int slot = -1;
+		return slot;
+	}
+
+	// Name of the region the calling thread is executing, or NULL if it is not inside one. Only pools whose policy has
+	// STATS set it. Read by the sampling profiler from a signal handler, so it is a plain pointer to a string that
+	// outlives the region.
+	inline const char*& currentRegionName(void) {
+		static thread_local const char* name = NULL;
+		return name;
+	}
+
+	// What a worker is executing, for watchdogs. Written by the worker, read by any thread
+	struct ChunkWatch {
+		std::atomic<int64> start;        // When the current chunk started, in ns. 0 if the worker is not executing one
+		std::atomic<int> begin;          // Iterations [begin, end) of the current chunk. -1 if not in a loop
+		std::atomic<int> end;
+		std::atomic<const char*> region; // Name of the region the chunk belongs to
+	};
+
+	// The chunk watch of the calling thread, or NULL if nobody is watching it
+	inline ChunkWatch*& currentChunkWatch(void) {
+		static thread_local ChunkWatch* watch = NULL;
+		return watch;
+	}
+
+	// A snapshot of a ChunkWatch
+	struct ChunkInfo {
+		int64 start;        // When the chunk started, in ns
+		int begin, end;     // Iterations of the chunk, -1 if not in a loop
+		const char* region; // Name of the region
+	};
+
+	// How much of the time spent executing jobs a worker, or the workers of a region, actually had a processor
+	struct PreemptionStats {
+		const char* region;        // Name of the region. NULL for the totals of a worker
+		int64 jobs;                // Job indices executed
+		int64 wallNs;              // Wall time spent executing them
+		int64 cpuNs;               // Processor time the threads got while executing them
+		int64 involuntarySwitches; // How many times the threads were descheduled although they could run
+
+		// Time spent off the processor while executing - preemption, hypervisor steal, but also blocking.
+		// Involuntary switches tell preemption apart from blocking, which does not cause any.
+		int64 getOffCpuNs(void) const { return wallNs > cpuNs ? wallNs - cpuNs : 0; }
+	};
 
 	// Return the number of processors available on the system
 	static int getProcessorCount(void) {
@@ -20,21 +126,73 @@ namespace a7az0th {
 
 	// A simple mutex. Used by threads to lock a section of code so that only the locker thread can execute the code
 	// When the mutex is locked all threads arriving at the location are stopped until the working thread unlocks it
+	// With THREADMAN_LOCK_PROFILING defined every acquisition is recorded by the LockProfiler.
 	class Mutex {
 		std::mutex csect;
+#ifdef THREADMAN_LOCK_PROFILING
+		const char* name;      // Shown in the lock profile
+		LockSiteStats* holder; // Call site of the current owner. Only touched by the owner
+		int64 acquiredAt;      // When the current owner acquired the mutex
+#endif
 		Mutex(const Mutex& rhs) = delete; // non-copyable class...
 		Mutex& operator = (const Mutex& rhs) = delete; // ... disallow evil constructors
 	public:
+#ifdef THREADMAN_LOCK_PROFILING
+		Mutex() : name(NULL), holder(NULL), acquiredAt(0) {}
+		~Mutex() {}
+		// Names the mutex in the lock profile. The string must outlive the mutex
+		void setName(const char* lockName) { name = lockName; }
+		// The call site is recorded with the acquisition
+		void enter(const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+			LockSiteStats* site = LockProfiler::getSite(this, file, line);
+			int64 now = getTimeNs();
+			const bool contended = !csect.try_lock();
+			if (contended) {
+				const int64 start = now;
+				csect.lock();
+				now = getTimeNs();
+				LockProfiler::recordAcquire(site, name, now - start, true);
+			} else {
+				LockProfiler::recordAcquire(site, name, 0, false);
+			}
+			holder = site;
+			acquiredAt = now;
+		}
+		void leave(void) {
+			LockSiteStats* site = holder;
+			const int64 held = getTimeNs() - acquiredAt;
+			holder = NULL;
+			csect.unlock();
+			LockProfiler::recordRelease(site, held);
+		}
+#else
 		Mutex() {}
 		~Mutex() {}
+		// Names the mutex in the lock profile. Does nothing unless THREADMAN_LOCK_PROFILING is defined
+		void setName(const char*) {}
 		void enter(void) { csect.lock(); }
 		void leave(void) { csect.unlock(); }
+#endif
+		// BasicLockable, so that a Mutex can be waited on with std::condition_variable_any.
+		// Acquisitions from inside the standard library are recorded at its line, so prefer MutexLock there.
+#ifdef THREADMAN_LOCK_PROFILING
+		void lock(const char* file = __builtin_FILE(), int line = __builtin_LINE()) { enter(file, line); }
+#else
+		void lock(void) { enter(); }
+#endif
+		void unlock(void) { leave(); }
 	};
 
 	struct MutexRAII {
+#ifdef THREADMAN_LOCK_PROFILING
+		MutexRAII(Mutex& m, const char* file = __builtin_FILE(), int line = __builtin_LINE()) : mutex(m) {
+			mutex.enter(file, line);
+		}
+#else
 		MutexRAII(Mutex& m) : mutex(m) {
 			mutex.enter();
 		}
+#endif
 		~MutexRAII() {
 			mutex.leave();
 		}
@@ -42,41 +200,134 @@ namespace a7az0th {
 		Mutex& mutex;
 	};
 
+	// A std::unique_lock for Mutex to wait on with std::condition_variable_any.
+	// The lock profile records every acquisition, including the ones after a wait, at the line that created the lock.
+	class MutexLock {
+	public:
+#ifdef THREADMAN_LOCK_PROFILING
+		MutexLock(Mutex& m, const char* file = __builtin_FILE(), int line = __builtin_LINE()) : mutex(m), file(file), line(line), owns(false) {
+			lock();
+		}
+		void lock(void) {
+			mutex.enter(file, line);
+			owns = true;
+		}
+#else
+		MutexLock(Mutex& m) : mutex(m), owns(false) {
+			lock();
+		}
+		void lock(void) {
+			mutex.enter();
+			owns = true;
+		}
+#endif
+		void unlock(void) {
+			owns = false;
+			mutex.leave();
+		}
+		~MutexLock() {
+			if (owns) {
+				mutex.leave();
+			}
+		}
+	private:
+		Mutex& mutex;
+#ifdef THREADMAN_LOCK_PROFILING
+		const char* file;
+		int line;
+#endif
+		bool owns; // Whether the mutex is held
+		MutexLock(const MutexLock&) = delete;
+		MutexLock& operator=(const MutexLock&) = delete;
+	};
+
 	// A simple blocking event used in inter-thread communication
 	// Used to signal the waiting threads that a condition has been met
+	// A signal sent while nobody is waiting is not lost - the next call to wait() returns immediately.
 	class Event {
 		std::condition_variable c;
 		std::mutex m;
+		bool signalled;      // Set by signal(), cleared by the thread it releases
+		unsigned generation; // Incremented by signalAll(), releases everybody waiting at that moment
 		Event(const Event& rhs) = delete; // non-copyable class...
 		Event& operator = (const Event& rhs) = delete; // ... disallow evil constructors
 	public:
-		Event(void) {}
+		Event(void) : signalled(false), generation(0) {}
 		~Event(void) {}
 		// Start waiting on the condition
 		void wait(void) {
 			std::unique_lock<std::mutex> lk(m);
-			c.wait(lk);
+			const unsigned gen = generation;
+			while (!signalled && gen == generation) {
+				c.wait(lk);
+			}
+			if (gen == generation) {
+				signalled = false;
+			}
 			lk.unlock();
 		}
+		// Consumes a pending signal without blocking. Returns false if there was none
+		bool tryWait(void) {
+			std::unique_lock<std::mutex> lk(m);
+			const bool res = signalled;
+			signalled = false;
+			return res;
+		}
 		// Release one waiting thread
 		void signal(void) {
 			std::unique_lock<std::mutex> lk(m);
+			signalled = true;
 			c.notify_one();
 			lk.unlock();
 		}
 		// Release all waiting threads
 		void signalAll(void) {
 			std::unique_lock<std::mutex> lk(m);
+			++generation;
 			c.notify_all();
 			lk.unlock();
 
 		}
 	};
 
+	// How idle workers wait for the next job
+	enum WaitStrategy {
+		WAIT_PARK = 0, // Block on an event. Costs nothing while idle, but waking takes a few microseconds
+		WAIT_HYBRID,   // Block, except for the workers dedicated with ThreadManager::setBusyPolling
+		WAIT_SPIN,     // Every worker busy-polls. Fastest dispatch, but idle workers burn their processors
+	};
 
-	struct ThreadManager;
+	// Compile-time configuration of a ThreadManagerT. Derive from it and override what you need, e.g.
+	//   struct MyPolicy : DefaultPolicy { static const WaitStrategy WAIT = WAIT_SPIN; static const bool STATS = false; };
+	//   ThreadManagerT<MyPolicy> pool;
+	// Features a policy turns off are compiled out of the hot paths instead of being checked at runtime.
+	struct DefaultPolicy {
+		static const WaitStrategy WAIT = WAIT_HYBRID;
+		// Split ranges by the capacity of the cores the workers are pinned to, see MultiThreaded::getRange
+		static const bool WEIGHTED_PARTITION = true;
+		// Stats segment, chunk watching and preemption tracking. Without it those calls do nothing
+		static const bool STATS = true;
+		// USDT probes of the pool, see tracepoints.h
+		static const bool TRACING = true;
+		// Most workers the pool can have. With fewer the pool is smaller, and runs asking for more threads
+		// than that execute the rest of the indices on the calling thread
+		static const int MAX_WORKERS = MAX_CPU_COUNT;
+	};
+
+	// A pool for latency critical paths - busy-polling workers, uniform partitioning and no instrumentation
+	struct LowLatencyPolicy : DefaultPolicy {
+		static const WaitStrategy WAIT = WAIT_SPIN;
+		static const bool WEIGHTED_PARTITION = false;
+		static const bool STATS = false;
+		static const bool TRACING = false;
+	};
+
+	template <class Policy> struct ThreadManagerT;
+	typedef ThreadManagerT<DefaultPolicy> ThreadManager;
+	typedef ThreadManagerT<LowLatencyPolicy> LowLatencyThreadManager;
 
 	struct MultiThreaded {
+		MultiThreaded() : weights(NULL), name(NULL) {}
 		virtual ~MultiThreaded() {}
 
 		// This does the actual work. It will be called by every thread spawned
@@ -85,18 +336,168 @@ namespace a7az0th {
 		virtual void threadProc(int index, int numThreads) = 0;
 
 		// Call this to run the code on the desired number of threads
-		void run(ThreadManager& threadman, int numThreads);
+		template <class Policy>
+		void run(ThreadManagerT<Policy>& threadman, int numThreads);
+
+		// Sets the name profiling and tracing tools show for this region. The string must outlive the region.
+		void setName(const char* regionName) { name = regionName; }
+		// Returns the name set with setName, or the (mangled) name of the class if none was set
+		const char* getName(void) const { return name ? name : typeid(*this).name(); }
+
+	protected:
+		// Statically splits [0, count) into numThreads contiguous ranges and returns the one for the given worker.
+		// On hybrid CPUs, when the thread manager pins its workers, each range is sized by the capacity of the
+		// core the worker runs on, so that fast and slow cores finish at about the same time.
+		// @param index The index of the current worker thread, as passed to threadProc
+		// @param numThreads The total number of workers, as passed to threadProc
+		// @param count The size of the range to split
+		// @param[out] begin, end The range [begin, end) the worker should process
+		void getRange(int index, int numThreads, int count, int& begin, int& end) const {
+			if (weights) {
+				const long long total = weights[numThreads];
+				begin = int(count * weights[index] / total);
+				end = int(count * weights[index + 1] / total);
+			} else {
+				begin = int((long long)(count) * index / numThreads);
+				end = int((long long)(count) * (index + 1) / numThreads);
+			}
+		}
+
+	private:
+		template <class Policy> friend struct ThreadManagerT;
+		const long long* weights; // Prefix sums of the worker capacities for the current run. NULL if uniform
+		const char* name;         // Name shown by profiling and tracing tools. NULL for the class name
+	};
+
+	// Remembers how fast a loop runs with different numbers of workers and settles on the smallest count that
+	// reaches the throughput plateau. Meant for memory bound loops, where workers past the bandwidth knee only add
+	// contention and power, and are better left free for other jobs.
+	// Keep one instance per call site (a static is fine) and attach it to the loop with MultiThreadedFor::setThrottle.
+	class ConcurrencyThrottle {
+	public:
+		// @param plateau Fraction of the best throughput that is considered good enough
+		// @param reprobeInterval After that many runs the measurements are dropped and the search starts over
+		ConcurrencyThrottle(double plateau = 0.95, int reprobeInterval = 256)
+			: plateau(plateau), reprobeInterval(reprobeInterval), maxThreads(0), low(0), high(0), runs(0) {
+			reset(0);
+			mutex.setName("ConcurrencyThrottle");
+		}
+
+		// Returns how many workers the next run should use
+		// @param limit The most workers the caller is willing to use
+		int choose(int limit) {
+			MutexRAII lock(mutex);
+			limit = std::max(1, std::min(limit, MAX_CPU_COUNT));
+			if (limit != maxThreads || ++runs >= reprobeInterval) {
+				reset(limit);
+			}
+
+			// Coarse pass - halve from the limit down to one (12, 6, 3, 1), so that the best throughput is known
+			for (int n = maxThreads; ; n = std::max(1, n / 2)) {
+				if (throughput[n] == 0) return n;
+				if (n == 1) break;
+			}
+			// Fine pass - binary search for the smallest count on the plateau
+			if (high == 0) {
+				findBounds();
+			}
+			if (high - low > 1) {
+				const int mid = (low + high) / 2;
+				if (throughput[mid] == 0) return mid;
+			}
+			return high;
+		}
+
+		// Reports how a run went
+		// @param numThreads The number of threads the run actually used, which a busy pool may have made fewer than
+		// choose() asked for
+		// @param work Amount of work done, e.g. iterations or bytes
+		// @param elapsedNs How long the run took
+		void report(int numThreads, int64 work, int64 elapsedNs) {
+			if (numThreads < 1 || numThreads > MAX_CPU_COUNT || elapsedNs <= 0) return;
+			MutexRAII lock(mutex);
+			const double measured = double(work) / double(elapsedNs);
+			double& t = throughput[numThreads];
+			t = (t == 0) ? measured : (t * 3 + measured) / 4;
+			if (high != 0 && numThreads > low && numThreads < high) {
+				if (t >= plateau * best) {
+					high = numThreads;
+				} else {
+					low = numThreads;
+				}
+			}
+		}
+
+		// Returns the worker count the throttle has settled on, or 0 if still exploring
+		int getSettled(void) {
+			MutexRAII lock(mutex);
+			return (high != 0 && high - low <= 1) ? high : 0;
+		}
+
+	private:
+		Mutex mutex;          // Guards the state below. Only taken twice per run
+		double plateau;       // Fraction of the best throughput considered good enough
+		int reprobeInterval;  // Number of runs after which the search starts over
+		int maxThreads;       // The limit the measurements were taken for
+		int low;              // The largest count known to be below the plateau. 0 if not searched yet
+		int high;             // The smallest count known to be on the plateau. 0 if not searched yet
+		int runs;             // Runs since the last reset
+		double best;          // The best throughput measured in the coarse pass
+		double throughput[MAX_CPU_COUNT + 1]; // Average work per ns for every worker count. 0 if not measured
+
+		void reset(int limit) {
+			maxThreads = limit;
+			low = high = runs = 0;
+			best = 0;
+			for (int i = 0; i <= MAX_CPU_COUNT; i++) {
+				throughput[i] = 0;
+			}
+		}
+
+		// Called once the coarse pass is complete. Finds the smallest power of two on the plateau
+		// and the largest one below it, which bound the fine search.
+		void findBounds(void) {
+			best = 0;
+			for (int n = maxThreads; ; n = std::max(1, n / 2)) {
+				best = std::max(best, throughput[n]);
+				if (n == 1) break;
+			}
+			high = maxThreads;
+			for (int n = maxThreads; ; n = std::max(1, n / 2)) {
+				if (throughput[n] >= plateau * best) {
+					high = n;
+				} else {
+					low = n;
+					break;
+				}
+				if (n == 1) break;
+			}
+		}
 	};
 
 	struct MultiThreadedFor : MultiThreaded {
 	public:
+		MultiThreadedFor() : count(0), nsPerIteration(0), throttle(NULL), loop(&MultiThreadedFor::claimLoop<true, true>) {}
 		virtual ~MultiThreadedFor() {}
 
-		void run(ThreadManager& threadman, int numIterations, int numThreads) {
-			idx = 0;
-			count = numIterations;
-			MultiThreaded::run(threadman, numThreads);
-		}
+		// Call this to run the body numIterations times on the desired number of threads.
+		// With THREADS_AUTO the number of workers is chosen from the iteration count, the measured cost of an iteration
+		// and how many workers are already busy with other jobs. Small loops run inline on the calling thread.
+		// In that case iterations executed on the calling thread see threadIdx 0 of numThreads 1.
+		// With a throttle attached numThreads is only the upper limit, the throttle picks the actual count.
+		template <class Policy>
+		void run(ThreadManagerT<Policy>& threadman, int numIterations, int numThreads);
+
+		// Starts the loop like run() and returns without waiting for it, so the caller can overlap its own serial work
+		// with the loop. Wait on the returned handle before touching the results or running the loop again.
+		// Picking the thread count with THREADS_AUTO still runs the first iterations on the calling thread.
+		template <class Policy>
+		typename ThreadManagerT<Policy>::RunHandle runAsync(ThreadManagerT<Policy>& threadman, int numIterations, int numThreads);
+
+		// Attaches a throttle that measures the throughput of every run and converges on the smallest number of
+		// workers that reaches the plateau. NULL disables throttling.
+		void setThrottle(ConcurrencyThrottle* t) { throttle = t; }
+
 		// This does the actual work. It will be for every index in count
 		// @param index The index of the current worker thread, 0..numThreads-1;
 		// @param numThreads The total number of workers.
@@ -105,18 +506,128 @@ namespace a7az0th {
 	private:
 		std::atomic<int> idx; // Atomic counter keeping track of the current index
 		int count;            // How many times the thread procedure should be called
+		double nsPerIteration; // Running average of the cost of a single iteration. 0 if not measured yet
+		ConcurrencyThrottle* throttle; // Picks the number of workers for memory bound loops. May be NULL
+		void (MultiThreadedFor::*loop)(int, int); // claimLoop with the instrumentation of the pool the loop runs on
+
+		// Picks the claim loop that has exactly the instrumentation the policy of the pool builds in
+		template <class Policy>
+		void prepare(int numIterations) {
+			idx = 0;
+			count = numIterations;
+			loop = &MultiThreadedFor::claimLoop<Policy::STATS, Policy::TRACING>;
+		}
+
+		// Runs iterations on the calling thread for about the given time to measure how expensive they are.
+		// Returns the number of workers that would finish the remaining iterations fastest.
+		template <class Policy>
+		int chooseThreadCount(ThreadManagerT<Policy>& threadman, int maxThreads);
 
 		void threadProc(int index, int numThreads) final {
+			(this->*loop)(index, numThreads);
+		}
+
+		// Claims and executes iterations until none are left.
+		// WATCH publishes every iteration to the chunk watch of the worker, if it has one. TRACE fires the probes.
+		template <bool WATCH, bool TRACE>
+		void claimLoop(int index, int numThreads) {
 			int i = 0;
+			ChunkWatch* watch = WATCH ? currentChunkWatch() : NULL;
 			while ((i = idx++) < count) {
+				if (TRACE) {
+					THREADMAN_TRACE3(chunk_claim, this, i, index);
+				}
+				if (WATCH && watch) {
+					// start is 0 while the chunk is being changed, see ThreadManager::getWorkerChunk
+					watch->start.store(0, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_release);
+					watch->begin.store(i, std::memory_order_relaxed);
+					watch->end.store(i + 1, std::memory_order_relaxed);
+					watch->start.store(getTimeNs(), std::memory_order_release);
+				}
 				body(i, index, numThreads);
 			}
 		}
 	};
 
+	// Lets the iterations of a MultiThreadedFor run part of their body in index order, typically to emit results,
+	// while the rest of the body runs in parallel. Index i enters the section only after index i-1 has left it,
+	// so ordered output is pipelined with the computation instead of buffered and post-processed.
+	// The handoff is a ticket - leaving publishes the next index. There is no lock, except for threads that
+	// wait for their predecessor for long and park.
+	// Every index of the loop must pass through the section exactly once, or the ones after it wait forever.
+	// MultiThreadedFor claims indices in increasing order, so the predecessor of a waiting index is always being executed.
+	class OrderedSection {
+	public:
+		// @param first The index that may enter first
+		explicit OrderedSection(int first = 0) : ticket(first), sleepers(0) {}
+
+		// Makes the section ready for another loop. Nobody may be inside
+		void reset(int first = 0) { ticket = first; }
+
+		// Calls f once all lower indices have left the section
+		template <class F>
+		void run(int index, F&& f) {
+			enter(index);
+			f();
+			leave(index);
+		}
+
+		// Waits until all lower indices have left the section
+		void enter(int index) {
+			for (int spin = 0; spin < SPIN_COUNT; spin++) {
+				if (ticket.load(std::memory_order_acquire) == index) return;
+				cpuRelax();
+			}
+			std::unique_lock<std::mutex> lk(m);
+			++sleepers;
+			while (ticket.load(std::memory_order_seq_cst) != index) {
+				c.wait(lk);
+			}
+			--sleepers;
+		}
+
+		// Lets the next index in
+		void leave(int index) {
+			ticket.store(index + 1, std::memory_order_seq_cst);
+			if (sleepers.load(std::memory_order_seq_cst) > 0) {
+				std::unique_lock<std::mutex> lk(m);
+				c.notify_all();
+			}
+		}
+
+		// Passes an index through without doing anything in the section
+		void skip(int index) {
+			enter(index);
+			leave(index);
+		}
+
+	private:
+		static const int SPIN_COUNT = 1000; // How many times to check the ticket before parking
+
+		std::atomic<int> ticket;   // The index that may enter next
+		std::atomic<int> sleepers; // Threads parked on c. Changed only under m
+		std::mutex m;
+		std::condition_variable c;
+
+		OrderedSection(const OrderedSection&) = delete;
+		OrderedSection& operator=(const OrderedSection&) = delete;
+	};
+
 	// A generic thread manager. Responsible for creating, managing, scheduling and deallocating threads.
-	struct ThreadManager {
+	// Several threads may call run() at the same time. Each run reserves its own workers from the pool,
+	// so independent jobs execute concurrently and nested runs from inside a job are allowed.
+	// The Policy selects at compile time how workers wait, how ranges are partitioned and which instrumentation
+	// is built in, see DefaultPolicy. ThreadManager is the pool with the default policy.
+	template <class Policy>
+	struct ThreadManagerT {
 	private:
+		static_assert(Policy::MAX_WORKERS >= 1 && Policy::MAX_WORKERS <= MAX_CPU_COUNT, "MAX_WORKERS out of range");
+
+		// Stats segment, chunk watching and preemption tracking need a per-worker slot in the segment
+		static const bool STATS = Policy::STATS;
+		static const int MAX_WORKERS = Policy::MAX_WORKERS;
+
 		// The possible states a thread can be in
 		enum ThreadState {
 			THREAD_INIT = 100,
@@ -126,62 +637,188 @@ namespace a7az0th {
 			THREAD_DEAD
 		};
 
+		// Everything the workers of a single run() share
+		struct JobContext {
+			MultiThreaded *algorithm;      // The algorithm the threads are going to execute
+			std::atomic<int> counter;      // Number of workers still running. The last one to finish signals done
+			int64 dispatchStart;           // Time at which the caller started waking the workers, in ns
+			std::atomic<int64> lastStart;  // Time at which the last worker started executing, in ns
+			Event done;                    // Signalled by the last worker to finish. The caller of run() waits on it
+			bool spinning;                 // All workers busy-poll. The caller spins on counter instead of waiting on done
+			int numThreads;                // Number of indices of the job
+			int workers;                   // How many of them went to pool workers
+			long long weights[MAX_CPU_COUNT + 1]; // Capacity weights for static partitioning, see MultiThreaded::weights
+		};
+
+		// Shared by the threads started by a single spawnThreads() call
+		struct SpawnContext {
+			int first;                  // Slot of the first new thread
+			int count;                  // Number of new threads
+			size_t prefaultBytes;       // How much stack each new thread touches before parking
+			std::atomic<int> remaining; // Threads that have not parked yet
+			Event parked;               // Signalled when the last new thread parks
+		};
+
+		// Preemption counters of a worker. Only the worker writes them
+		struct PreemptionCounters {
+			std::atomic<const char*> region; // NULL for the totals, or an unused slot
+			std::atomic<int64> jobs, wallNs, cpuNs, switches;
+		};
+		// How many regions are tracked per worker. Jobs of further regions only count to the totals
+		static const int PREEMPTION_REGIONS = 16;
+
 		// Internal struct for "boss"/"worker" synchronization:
 		struct ThreadInfoStruct {
-			int index;                  // Index of the current thread
-			int numThreads;             // Total number of threads
+			int index;                  // Index of the current thread inside the job it runs
+			int numThreads;             // Total number of threads of the job it runs
 			Event changedState;         // Signalled when the thread changes state
-			Event* releaseMainThread;   // Threadman event. Used by the last thread to signal and unlock the ThreadMan
+			std::atomic<unsigned> dispatch; // Incremented when the thread changes state, if it is busy-polling
+			bool spinning;              // The thread never parks, it busy-polls dispatch instead
+			WorkerPriority priority;    // The scheduling class the thread switches to when it starts
+			int niceValue;              // The nice value for PRIORITY_NICE
+			std::atomic<bool> priorityFailed; // The thread could not switch to priority and runs at the normal one
+			SpawnContext* spawn;        // Set until the thread has started its share of the new threads and parked
+			std::atomic<int> tid;       // OS id of the thread. 0 until the thread has started
+			ChunkWatch watch;           // What the thread executes, if chunk watching is on
+			PreemptionCounters preemption[PREEMPTION_REGIONS + 1]; // Totals, followed by the regions the thread ran
+			JobContext taskJob;         // The job the thread runs when it is dispatched to drain the task queue
 			std::thread handle;         // Handle to the actual thread object
 			volatile ThreadState state; // The state of the current thread.
-			MultiThreaded *algorithm;   // The algorithm the thread is going to execute
-			std::atomic<int>* counter;  // A pointer to the atomic active thread counter. The threadman gets signalled when this reaches zero
-			volatile bool* jobsDone;
-		} info[MAX_CPU_COUNT];
+			JobContext *job;            // The job the thread is going to execute
+			std::atomic<bool> busy;     // Set while the thread is reserved by a run() call
+			int cpu;                    // The logical processor the thread is pinned to. -1 if not pinned
+			int capacity;               // Relative capacity of the processor the thread runs on
+		} info[MAX_WORKERS];
 
-		int threadsInPool;        // Number of threads currently inside the threadpool
-		bool workComplete;        // A flag indicating that all worker threads have finished
-		std::atomic<int> counter; // An atomic counter. Determines the number of currently working threads. Used to signal the main thread when all work is done
-		Event waitForThreads;     // A wait condifion. The threadmanager waits on this while the threads are working.
-		//volatile ThreadState state; // The state of the threadman main thread.
+		int threadsInPool;            // Number of threads currently inside the threadpool
+		std::atomic<int> busyWorkers; // Number of threads currently reserved by running jobs
+		Mutex poolLock;               // Guards spawning and reserving threads
+		std::atomic<int64> wakeCost;  // Running average of the time it takes to get one more worker going, in ns
+		std::vector<int> cpuOrder;      // The processors workers get pinned to, in order of spawning. Empty if not pinning
+		std::vector<int> cpuCapacities; // The capacity of each processor in cpuOrder
+		std::vector<int> spinCpus;      // Processors of the busy-polling workers. They occupy the first slots of the pool
+		WorkerPriority workerPriority;  // Scheduling class of newly spawned workers
+		int workerNice;                 // Nice value of newly spawned workers, for PRIORITY_NICE
+		size_t stackPrefault;           // How much stack newly spawned workers fault in
+		PoolStats* stats;               // Shared-memory segment the workers publish to. NULL if not publishing
+		char statsName[64];             // Name of the segment
+		std::atomic<int> chunkWatchers; // Workers publish the chunks they execute while this is non-zero
+		std::atomic<bool> trackPreemption; // Workers measure the processor time they get for every job
+
+		// The job workers run to execute submitted tasks
+		struct TaskDrainer : MultiThreaded {
+			ThreadManagerT* pool;
+			void threadProc(int, int) override { pool->drainTasks(); }
+		};
+		Mutex taskLock;                  // Guards the task state below
+		TaskRing<Task> tasks;            // Submitted tasks that have not started yet
+		int taskWorkers;                 // Threads draining the queue, including callers helping out
+		int tasksRunning;                // Tasks currently executing on the threads draining the queue
+		int taskHelpers;                 // Threads running a single task in runPendingTask. Not counted as drainers
+		std::condition_variable_any tasksIdle; // Notified when the last thread draining or helping is done
+		TaskDrainer drainer;
 
 		// Spawned threads enter here.
-		// When a thread comes here it will enter idle state and wait for the thread manager to release it.
-		// When the thread manager spawns all threads, it initializes their contexts and releases them
-		// At this point all threads unpause and call the thread procedure given by the user.
-		// The main thread is released when all spawned threads exit this method.
+		// When a thread comes here it will wait for the thread manager to release it.
+		// A run() call reserves the thread, gives it a job and releases it.
+		// When done with the job the thread makes itself available for other runs and goes back to waiting.
+		// The caller of run() is released when all its workers are done.
 		// @param info - The context of the thread spawned
-		static void exec(ThreadInfoStruct *info) {
+		void exec(ThreadInfoStruct *info) {
 			// Are we done?
 			bool done = false;
-			std::atomic<int>& cnt = *info->counter;
+			unsigned seen = 0;
+			currentWorkerSlot() = int(info - &this->info[0]);
+			info->tid = getCurrentThreadId();
+			if (info->spawn) {
+				// New threads are started as a binary tree, so creating the pool takes log(n) thread creations
+				SpawnContext* spawn = info->spawn;
+				info->spawn = NULL;
+				const int k = currentWorkerSlot() - spawn->first;
+				for (int child = 2 * k + 1; child <= 2 * k + 2 && child < spawn->count; child++) {
+					startThread(spawn->first + child);
+				}
+				prefaultStack(spawn->prefaultBytes);
+				if (0 == --spawn->remaining) {
+					spawn->parked.signal();
+				}
+			}
+			// Only now, so that the spawning above, which the caller waits for, does not run on idle cycles.
+			// Threads inherit the scheduling class, so the children started above are still at the normal one.
+			if (info->priority != PRIORITY_NORMAL && !setCurrentThreadPriority(info->priority, info->niceValue)) {
+				info->priorityFailed = true;
+			}
 			do {
-				// Set the current thread state to IDLE
-				// The thread manager needs to initialize rest of the thread data
-				// Before we can proceed with the execution
-				info->state = THREAD_IDLE;
-
+				if (STATS && stats) {
+					publishState(isSpinning(*info) ? POOL_WORKER_IDLE : POOL_WORKER_PARKED, getTimeNs());
+				}
 				// Wait for the thread to be woken from the thread manager
-				info->changedState.wait();
+				if (isSpinning(*info)) {
+					int rounds = 0;
+					while (info->dispatch.load(std::memory_order_acquire) == seen) {
+						spinWait(rounds);
+					}
+					seen = info->dispatch.load(std::memory_order_relaxed);
+				} else {
+					info->changedState.wait();
+				}
 
 				// The thread has been awoken!
 				// When the thread manager wakes a thread, it will set its state to RUNNING
 				switch (info->state) {
 				case THREAD_RUNNING: {
-					// If we have a job, do it
-					MultiThreaded *job = info->algorithm;
+					JobContext *job = info->job;
+					// Without STATS the wake cost is not measured and nothing below needs the time
+					const int64 now = STATS ? getTimeNs() : 0;
+					if (STATS) {
+						int64 last = job->lastStart;
+						while (last < now && !job->lastStart.compare_exchange_weak(last, now)) {}
+					}
 
-					if (job) {
-						job->threadProc(info->index, info->numThreads);
+					THREADMAN_POOL_TRACE3(worker_wake, job->algorithm, currentWorkerSlot(), info->index);
+					if (STATS && stats) {
+						publishStart(job, now);
 					}
+					if (STATS && chunkWatchers.load(std::memory_order_relaxed) > 0) {
+						// The whole index is a chunk, unless the algorithm reports finer ones
+						currentChunkWatch() = &info->watch;
+						info->watch.start.store(0, std::memory_order_relaxed);
+						std::atomic_thread_fence(std::memory_order_release);
+						info->watch.region.store(job->algorithm->getName(), std::memory_order_relaxed);
+						info->watch.begin.store(-1, std::memory_order_relaxed);
+						info->watch.end.store(-1, std::memory_order_relaxed);
+						info->watch.start.store(now, std::memory_order_release);
+					}
+					const bool track = STATS && trackPreemption.load(std::memory_order_relaxed);
+					const int64 cpuStart = track ? getThreadCpuTimeNs() : 0;
+					const int64 switchesStart = track ? getThreadInvoluntarySwitches() : 0;
+					execute(job->algorithm, info->index, info->numThreads);
+					if (track) {
+						recordPreemption(info, job->algorithm->getName(), getTimeNs() - now, getThreadCpuTimeNs() - cpuStart,
+							getThreadInvoluntarySwitches() - switchesStart);
+					}
+					if (STATS && currentChunkWatch()) {
+						info->watch.start.store(0, std::memory_order_release);
+						currentChunkWatch() = NULL;
+					}
+					if (STATS && stats) {
+						publishDone(now, getTimeNs());
+					}
+					THREADMAN_POOL_TRACE3(worker_done, job->algorithm, currentWorkerSlot(), info->index);
+
+					// Make the thread available before reporting so that a run() that returned can reuse it
+					info->job = NULL;
+					info->state = THREAD_IDLE;
+					--busyWorkers;
+					info->busy = false;
 
-					// After the job is done, decrease the global counter
-					// keeping track of the threads that are currently running.
-					if (0 == --cnt) {
-						// If this is the last threads
-						// Signal the thread manager that the main thread can continue.
-						*info->jobsDone = true;
-						info->releaseMainThread->signal();
+					// After the job is done, decrease the counter keeping track of the threads that are still working
+					// If this is the last thread signal the caller of run() that it can continue.
+					// A spinning caller may be gone as soon as counter hits zero, so check before decrementing.
+					if (job->spinning) {
+						--job->counter;
+					} else if (0 == --job->counter) {
+						job->done.signal();
 					}
 					break;
 				}
@@ -197,27 +834,372 @@ namespace a7az0th {
 			info->state = THREAD_DEAD;
 		}
 
-		// Used to add another thread to the threadpool
-		void spawnNewThread(void) {
-			// Get a context for the the next thread;
-			ThreadInfoStruct& ti = info[threadsInPool];
+		// Publishes a state change of the calling worker
+		void publishState(PoolWorkerState state, int64 now) {
+			PoolWorkerStats& ws = stats->workers[currentWorkerSlot()];
+			PoolWorkerStatsWriter writer(ws);
+			ws.state = state;
+			ws.stateSince = now;
+			ws.tid = info[currentWorkerSlot()].tid;
+		}
+
+		// Publishes that the calling worker started executing a job
+		void publishStart(const JobContext* job, int64 now) {
+			PoolWorkerStats& ws = stats->workers[currentWorkerSlot()];
+			PoolWorkerStatsWriter writer(ws);
+			const int64 wake = std::max(now - job->dispatchStart, int64(0));
+			ws.state = POOL_WORKER_RUNNING;
+			ws.stateSince = now;
+			ws.wakeNs += wake;
+			ws.wakeHistogram[getStatsBucket(wake)]++;
+			strncpy(ws.region, job->algorithm->getName(), POOL_STATS_NAME_SIZE - 1);
+		}
+
+		// Publishes that the calling worker finished the job it started at the given time
+		void publishDone(int64 start, int64 now) {
+			PoolWorkerStats& ws = stats->workers[currentWorkerSlot()];
+			PoolWorkerStatsWriter writer(ws);
+			ws.jobs++;
+			ws.busyNs += now - start;
+			ws.jobHistogram[getStatsBucket(now - start)]++;
+		}
+
+		// Adds a job to the totals of a worker and to its region
+		static void recordPreemption(ThreadInfoStruct* info, const char* region, int64 wall, int64 cpu, int64 switches) {
+			PreemptionCounters* counters[2] = { &info->preemption[0], NULL };
+			for (int i = 1; i <= PREEMPTION_REGIONS; i++) {
+				const char* name = info->preemption[i].region.load(std::memory_order_relaxed);
+				if (name == region || name == NULL) {
+					if (name == NULL) {
+						info->preemption[i].region.store(region, std::memory_order_relaxed);
+					}
+					counters[1] = &info->preemption[i];
+					break;
+				}
+			}
+			for (int i = 0; i < 2 && counters[i]; i++) {
+				// Single writer - no need for read-modify-write instructions
+				PreemptionCounters& c = *counters[i];
+				c.jobs.store(c.jobs.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				c.wallNs.store(c.wallNs.load(std::memory_order_relaxed) + wall, std::memory_order_relaxed);
+				c.cpuNs.store(c.cpuNs.load(std::memory_order_relaxed) + cpu, std::memory_order_relaxed);
+				c.switches.store(c.switches.load(std::memory_order_relaxed) + switches, std::memory_order_relaxed);
+			}
+		}
+
+		static PreemptionStats readPreemption(const PreemptionCounters& c) {
+			PreemptionStats res;
+			res.region = c.region;
+			res.jobs = c.jobs;
+			res.wallNs = c.wallNs;
+			res.cpuNs = c.cpuNs;
+			res.involuntarySwitches = c.switches;
+			return res;
+		}
+
+		// Runs queued tasks until the queue is empty. The calling thread must have been counted in taskWorkers
+		void drainTasks(void) {
+			Task task;
+			taskLock.enter();
+			while (tasks.pop(task)) {
+				tasksRunning++;
+				taskLock.leave();
+				task();
+				task.reset();
+				taskLock.enter();
+				tasksRunning--;
+			}
+			if (0 == --taskWorkers && 0 == taskHelpers) {
+				tasksIdle.notify_all();
+			}
+			taskLock.leave();
+		}
+
+		// Makes room in the queue for a range of tasks. Single-pass ranges can only be counted by consuming them,
+		// so they just grow the queue as they are pushed. Must be called with taskLock held.
+		template <class Iterator>
+		void reserveTasks(Iterator first, Iterator last, std::forward_iterator_tag) {
+			tasks.reserve(std::distance(first, last));
+		}
+		template <class Iterator>
+		void reserveTasks(Iterator, Iterator, std::input_iterator_tag) {}
+
+		// Returns how many more threads should drain the queue and counts them in taskWorkers.
+		// Every queued task that no idle drainer can pick up gets one, up to one drainer per processor.
+		// Must be called with taskLock held.
+		int claimTaskWorkers(void) {
+			const int idle = taskWorkers - tasksRunning;
+			const int limit = std::min(int(MAX_WORKERS), getProcessorCount());
+			const int wanted = std::min(int(tasks.size()) - idle, limit - taskWorkers);
+			if (wanted <= 0) return 0;
+			taskWorkers += wanted;
+			return wanted;
+		}
 
-			// Initialize the context
-			ti.index = threadsInPool;               // Set the new thread's ID
-			ti.state = THREAD_INIT;                 // Set initial thread state
-			ti.releaseMainThread = &waitForThreads; // Give the workers a way to signal the main thread when they are done
-			ti.algorithm = NULL;                    // Set the job to NULL (initially)
-			ti.counter = &counter;
-			ti.jobsDone = &workComplete;
+		// Dispatches up to count workers to drain the task queue. Must be called without taskLock held.
+		// If no worker is free and nobody else drains the queue, the caller drains it.
+		void startTaskWorkers(int count) {
+			int slots[MAX_WORKERS];
+			const int workers = reserveWorkers(slots, count);
+			const int64 now = STATS ? getTimeNs() : 0;
+			for (int i = 0; i < workers; i++) {
+				ThreadInfoStruct& ti = info[slots[i]];
+				ti.taskJob.counter = 1;
+				ti.taskJob.lastStart = 0;
+				ti.taskJob.dispatchStart = now;
+				ti.index = 0;
+				ti.numThreads = 1;
+				ti.job = &ti.taskJob;
+				ti.state = THREAD_RUNNING;
+				THREADMAN_POOL_TRACE3(dispatch, &drainer, slots[i], 0);
+				wake(ti);
+			}
+			if (workers == count) {
+				return;
+			}
+			bool drainHere = false;
+			{
+				MutexRAII lock(taskLock);
+				taskWorkers -= count - workers;
+				if (taskWorkers == 0 && !tasks.empty()) {
+					taskWorkers = 1;
+					drainHere = true;
+				}
+			}
+			if (drainHere) {
+				drainTasks();
+			}
+		}
+
+		// Runs a single index of a job on the calling thread
+		static void execute(MultiThreaded* job, int index, int numThreads) {
+			if (!STATS) {
+				job->threadProc(index, numThreads);
+				return;
+			}
+			const char*& region = currentRegionName();
+			const char* outer = region;
+			region = job->getName();
+			job->threadProc(index, numThreads);
+			region = outer;
+		}
+
+		// Creates the OS thread for an initialized slot and pins it
+		void startThread(int slot) {
+			ThreadInfoStruct& ti = info[slot];
 			// Run a thread with the context provided and get a pointer to it.
-			ti.handle = std::thread(&exec, &ti);
+			ti.handle = std::thread(&ThreadManagerT::exec, this, &ti);
+			pinThread(slot);
+		}
+
+		// Used to add more threads to the threadpool. Must be called with poolLock held.
+		// The caller starts one thread and every new thread starts up to two more, so they get created in parallel.
+		// Returns when all new threads have parked.
+		void spawnThreads(int count) {
+			count = std::min(count, MAX_WORKERS - threadsInPool);
+			if (count <= 0) {
+				return;
+			}
+			SpawnContext spawn;
+			spawn.first = threadsInPool;
+			spawn.count = count;
+			spawn.prefaultBytes = stackPrefault;
+			spawn.remaining = count;
+
+			for (int i = threadsInPool; i < threadsInPool + count; i++) {
+				// Initialize the context
+				ThreadInfoStruct& ti = info[i];
+				ti.index = i;                           // Set the new thread's ID
+				ti.numThreads = 1;
+				ti.state = THREAD_INIT;                 // Set initial thread state
+				ti.job = NULL;                          // Set the job to NULL (initially)
+				ti.busy = false;
+				ti.dispatch = 0;
+				ti.spinning = (Policy::WAIT == WAIT_SPIN) || (Policy::WAIT == WAIT_HYBRID && i < int(spinCpus.size()));
+				ti.priority = workerPriority;
+				ti.niceValue = workerNice;
+				ti.priorityFailed = false;
+				ti.spawn = &spawn;
+				ti.tid = 0;
+				ti.watch.start = 0;
+				ti.taskJob.algorithm = &drainer;
+				ti.taskJob.spinning = true; // Nobody waits for a task job, so there is nothing to signal
+				for (int r = 0; r <= PREEMPTION_REGIONS; r++) {
+					PreemptionCounters& c = ti.preemption[r];
+					c.region = NULL;
+					c.jobs = c.wallNs = c.cpuNs = c.switches = 0;
+				}
+			}
+			startThread(threadsInPool);
+			spawn.parked.wait();
 
 			// Increment the number of currently active threads
-			++threadsInPool;
+			threadsInPool += count;
+			if (STATS && stats) {
+				stats->numWorkers = threadsInPool;
+			}
+		}
 
-			// Update the number of currently active threads throughout all thread contexts
-			for (int i = 0; i < threadsInPool; i++) {
-				info[i].numThreads = threadsInPool;
+		// Dispatches a job to as many workers as can be reserved and executes the indices left over on the calling thread
+		void startJob(JobContext& ctx, MultiThreaded* job, int numThreads) {
+			THREADMAN_POOL_TRACE3(run_start, job, job->getName(), numThreads);
+			if (STATS && stats) {
+				stats->runs++;
+			}
+			ctx.algorithm = job;
+			ctx.numThreads = numThreads;
+			ctx.workers = 0;
+			ctx.counter = 0;
+			if (numThreads <= 1) {
+				execute(job, 0, 1);
+				return;
+			}
+			assert(numThreads <= MAX_CPU_COUNT);
+
+			int slots[MAX_WORKERS];
+			const int workers = reserveWorkers(slots, numThreads);
+			ctx.workers = workers;
+
+			// Capacity weights for static partitioning. Only meaningful if workers are pinned.
+			if (Policy::WEIGHTED_PARTITION && !cpuOrder.empty()) {
+				long long* weights = ctx.weights;
+				weights[0] = 0;
+				for (int i = 0; i < numThreads; i++) {
+					weights[i + 1] = weights[i] + (i < workers ? info[slots[i]].capacity : CpuTopology::MAX_CAPACITY);
+				}
+				job->weights = weights;
+			}
+
+			ctx.counter = workers;
+			ctx.lastStart = 0;
+			ctx.spinning = (Policy::WAIT != WAIT_PARK);
+			for (int i = 0; Policy::WAIT == WAIT_HYBRID && i < workers; i++) {
+				ctx.spinning = ctx.spinning && info[slots[i]].spinning;
+			}
+
+			ctx.dispatchStart = STATS ? getTimeNs() : 0;
+			for (int i = 0; i < workers; i++) {
+				ThreadInfoStruct& ti = info[slots[i]];
+				ti.index = i;               // Set its index
+				ti.numThreads = numThreads; // Set total number of threads
+				ti.job = &ctx;              // Init the function that is going to be executed
+
+				// Signal the thread to begin
+				ti.state = THREAD_RUNNING;
+				THREADMAN_POOL_TRACE3(dispatch, job, slots[i], i);
+				wake(ti);
+			}
+
+			// Whatever the pool could not take is done here
+			if (STATS && stats && workers < numThreads) {
+				stats->inlineJobs += numThreads - workers;
+			}
+			for (int i = workers; i < numThreads; i++) {
+				THREADMAN_POOL_TRACE3(inline_exec, job, i, numThreads);
+				execute(job, i, numThreads);
+			}
+		}
+
+		// Waits for the workers of a job started with startJob.
+		// The event remembers the signal, so it is not lost if all workers are done before we get here.
+		void joinJob(JobContext& ctx) {
+			if (ctx.workers == 0) return;
+			if (ctx.spinning) {
+				int rounds = 0;
+				while (ctx.counter.load(std::memory_order_acquire) != 0) {
+					spinWait(rounds);
+				}
+			} else {
+				ctx.done.wait();
+			}
+		}
+
+		// The workers a job got, plus the calling thread if it executed the indices they could not take.
+		// The caller executes those one after another, so it adds one thread however many indices it got.
+		static int getConcurrency(const JobContext& ctx) {
+			return (ctx.workers < ctx.numThreads) ? ctx.workers + 1 : ctx.workers;
+		}
+
+		// Bookkeeping after the workers of a job are done
+		void finishJob(JobContext& ctx) {
+			const int workers = ctx.workers;
+			if (STATS && workers > 0) {
+				const int64 wakeNs = ctx.lastStart - ctx.dispatchStart;
+				THREADMAN_POOL_TRACE3(join, ctx.algorithm, workers, wakeNs);
+				wakeCost = (wakeCost * 7 + wakeNs / workers) / 8;
+			}
+			ctx.algorithm->weights = NULL;
+			THREADMAN_POOL_TRACE3(run_end, ctx.algorithm, ctx.numThreads, workers);
+		}
+
+		// Reserves up to numThreads idle workers, spawning new ones if needed.
+		// Fewer are returned only if the pool has reached MAX_WORKERS threads and the rest are busy.
+		// @param[out] slots The indices of the reserved workers
+		// @returns The number of workers reserved
+		int reserveWorkers(int* slots, int numThreads) {
+			MutexRAII lock(poolLock);
+			int reserved = 0;
+			for (int i = 0; i < threadsInPool && reserved < numThreads; i++) {
+				if (!info[i].busy) {
+					info[i].busy = true;
+					slots[reserved++] = i;
+				}
+			}
+			if (reserved < numThreads) {
+				const int first = threadsInPool;
+				spawnThreads(numThreads - reserved);
+				for (int i = first; i < threadsInPool; i++) {
+					info[i].busy = true;
+					slots[reserved++] = i;
+				}
+			}
+			busyWorkers += reserved;
+			return reserved;
+		}
+
+		// Binds a worker to its processor according to the current core preference.
+		// The first workers go to the processors given to setBusyPolling, whether or not the policy lets them spin.
+		void pinThread(int index) {
+			ThreadInfoStruct& ti = info[index];
+			ti.cpu = -1;
+			ti.capacity = CpuTopology::MAX_CAPACITY;
+			if (index < int(spinCpus.size())) {
+				if (setThreadAffinity(ti.handle, spinCpus[index])) {
+					ti.cpu = spinCpus[index];
+					ti.capacity = getCpuCapacity(ti.cpu);
+				}
+				return;
+			}
+			if (cpuOrder.empty()) {
+				return;
+			}
+			const int slot = index % int(cpuOrder.size());
+			if (setThreadAffinity(ti.handle, cpuOrder[slot])) {
+				ti.cpu = cpuOrder[slot];
+				ti.capacity = cpuCapacities[slot];
+			}
+		}
+
+		// Returns the capacity of a processor in the topology given to setCorePreference. Without one the capacities
+		// are not used, and every processor counts as full capacity
+		int getCpuCapacity(int cpu) const {
+			for (size_t i = 0; i < cpuOrder.size(); i++) {
+				if (cpuOrder[i] == cpu) return cpuCapacities[i];
+			}
+			return CpuTopology::MAX_CAPACITY;
+		}
+
+		// Whether a worker busy-polls. Known at compile time unless the wait strategy is WAIT_HYBRID
+		static bool isSpinning(const ThreadInfoStruct& ti) {
+			return (Policy::WAIT == WAIT_SPIN) || (Policy::WAIT == WAIT_HYBRID && ti.spinning);
+		}
+
+		// Lets a worker know its state has changed
+		static void wake(ThreadInfoStruct& ti) {
+			if (isSpinning(ti)) {
+				ti.dispatch.fetch_add(1, std::memory_order_release);
+			} else {
+				ti.changedState.signal();
 			}
 		}
 
@@ -226,81 +1208,506 @@ namespace a7az0th {
 		}
 
 		// Disallow evil constructors.
-		ThreadManager(const ThreadManager& rhs) = delete;
-		ThreadManager& operator = (const ThreadManager& rhs) = delete;
+		ThreadManagerT(const ThreadManagerT& rhs) = delete;
+		ThreadManagerT& operator = (const ThreadManagerT& rhs) = delete;
 	public:
-		ThreadManager() : threadsInPool(0), counter(0) {}
-		~ThreadManager() { killall(); }
+		// Initial guess for the cost of waking a worker, until one is measured. Without STATS it is never measured,
+		// and busy-polling workers only need a cache line transfer to pick up a job
+		static const int64 DEFAULT_WAKE_COST_NS = (!Policy::STATS && Policy::WAIT == WAIT_SPIN) ? 1000 : 10000;
+
+		ThreadManagerT()
+			: threadsInPool(0), busyWorkers(0), wakeCost(DEFAULT_WAKE_COST_NS), workerPriority(PRIORITY_NORMAL), workerNice(0),
+			  stackPrefault(0), stats(NULL), chunkWatchers(0), trackPreemption(false), taskWorkers(0), tasksRunning(0), taskHelpers(0) {
+			poolLock.setName("ThreadManager::poolLock");
+			taskLock.setName("ThreadManager::taskLock");
+			drainer.pool = this;
+			drainer.setName("tasks");
+		}
+		~ThreadManagerT() {
+			waitForTasks();
+			killall();
+			if (stats) {
+				closeStatsSegment(stats, statsName);
+			}
+		}
+
+		// Pins the workers to the processors of the given topology.
+		// With PREFER_PERFORMANCE workers are placed on P-cores first, so latency critical jobs that use
+		// fewer threads than there are cores run only on the fast cores. PREFER_EFFICIENCY does the opposite and
+		// is meant for pools running background work. PREFER_NONE lets the OS place the threads.
+		// Can be called at any time, already running workers are re-pinned.
+		void setCorePreference(const CpuTopology& topology, CorePreference pref) {
+			MutexRAII lock(poolLock);
+			cpuOrder.clear();
+			cpuCapacities.clear();
+			if (pref != PREFER_NONE) {
+				cpuOrder = topology.getCpuOrder(pref);
+				for (size_t i = 0; i < cpuOrder.size(); i++) {
+					cpuCapacities.push_back(topology.getCapacity(cpuOrder[i]));
+				}
+			}
+			for (int i = 0; i < threadsInPool; i++) {
+				pinThread(i);
+			}
+		}
+
+		// Dedicates the given processors to workers that never park. Each of them is pinned to its processor and
+		// busy-polls a dispatch word, so a run that only needs those workers starts in well under a microsecond and
+		// the caller spins until they are done instead of sleeping. Meant for latency critical paths on isolated
+		// cores (e.g. isolcpus) - the processors are burnt even when there is no work.
+		// Must be called before the first run. An empty list turns the mode off.
+		// This is the WAIT_HYBRID strategy. With WAIT_SPIN every worker busy-polls anyway and the list only says where
+		// the first workers are pinned, with WAIT_PARK the workers are pinned there but still park.
+		void setBusyPolling(const std::vector<int>& cpus) {
+			MutexRAII lock(poolLock);
+			assert(threadsInPool == 0);
+			spinCpus = cpus;
+			if (spinCpus.size() > size_t(MAX_WORKERS)) {
+				spinCpus.resize(MAX_WORKERS);
+			}
+		}
+
+		// Makes the workers of this pool run at a lower OS priority. Use a separate ThreadManager configured this way
+		// for bulk jobs, so they only consume otherwise idle cycles and do not inflate the latency of foreground threads.
+		// Combine with setCorePreference(..., PREFER_EFFICIENCY) to also keep them on the E-cores of hybrid CPUs.
+		// Indices executed on the calling thread run at the priority of the caller.
+		// A worker switches once it has started, see getPriorityFailures for whether that worked.
+		// Must be called before the first run.
+		// @param prio PRIORITY_IDLE for SCHED_IDLE, PRIORITY_NICE for a raised nice value
+		// @param niceValue The nice value for PRIORITY_NICE, or the fallback if SCHED_IDLE is unavailable
+		void setWorkerPriority(WorkerPriority prio, int niceValue = 19) {
+			MutexRAII lock(poolLock);
+			assert(threadsInPool == 0);
+			workerPriority = prio;
+			workerNice = niceValue;
+		}
+
+		// Creates the workers up front, so that the first run does not pay for starting the pool.
+		// The threads are created in parallel, each touches stackBytes of its stack and is pinned according to
+		// setCorePreference() and setBusyPolling(), which should be called before this.
+		// Returns once all of them are parked and ready to take work.
+		// @param numThreads How many workers the pool should have
+		// @param stackBytes How much of each worker's stack to fault in. Also used for workers spawned later
+		void warmup(int numThreads = getProcessorCount(), size_t stackBytes = 64 * 1024) {
+			MutexRAII lock(poolLock);
+			stackPrefault = stackBytes;
+			spawnThreads(numThreads - threadsInPool);
+		}
+
+		// Publishes the state of every worker, the region it executes, counters and latency histograms to a
+		// shared-memory segment, so that tools like threadman-top can watch the pool of a running process.
+		// Workers update their own slot only, so publishing costs a few stores per job and no contention.
+		// The segment is removed when the ThreadManager is destroyed. Linux only.
+		// Must be called before the first run.
+		// @param name Name of the segment. NULL for "/threadman-<pid>". Give every published pool of a process its own
+		// @returns false if the segment could not be created, or the policy has no STATS
+		bool publishStats(const char* name = NULL) {
+			if (!STATS) return false;
+			MutexRAII lock(poolLock);
+			assert(threadsInPool == 0 && !stats);
+			if (name) {
+				snprintf(statsName, sizeof(statsName), "%s", name);
+			} else {
+				getStatsSegmentName(statsName, sizeof(statsName));
+			}
+			stats = createStatsSegment(statsName);
+			return stats != NULL;
+		}
+
+		// Returns the number of workers in the pool
+		int getThreadCount(void) {
+			MutexRAII lock(poolLock);
+			return threadsInPool;
+		}
+
+		// Returns how many workers could not switch to the priority set with setWorkerPriority and run at the normal one.
+		// A worker switches right after it is spawned and parked, so this may still miss workers that were just spawned
+		int getPriorityFailures(void) {
+			MutexRAII lock(poolLock);
+			int res = 0;
+			for (int i = 0; i < threadsInPool; i++) {
+				res += info[i].priorityFailed ? 1 : 0;
+			}
+			return res;
+		}
+
+		// Returns the OS thread id of a worker, for tools that attach to threads. 0 if unknown
+		// @param slot The slot of the worker, 0..getThreadCount()-1
+		int getWorkerTid(int slot) const { return info[slot].tid; }
+
+		// Returns the native handle of a worker
+		// @param slot The slot of the worker, 0..getThreadCount()-1
+		std::thread::native_handle_type getWorkerHandle(int slot) { return info[slot].handle.native_handle(); }
+
+		// Makes the workers publish when they start every chunk they execute - an iteration of a MultiThreadedFor, or
+		// a whole index of other algorithms - so that a watchdog can spot chunks that take too long.
+		// Costs a clock read per iteration while on. Takes effect with the next job a worker starts.
+		// Watching is on while at least one watcher is registered, so several watchdogs can share a pool.
+		// Does nothing if the policy has no STATS.
+		void addChunkWatcher(void) { chunkWatchers++; }
+		void removeChunkWatcher(void) { chunkWatchers--; }
+
+		// Returns what a worker is executing
+		// @param slot The slot of the worker, 0..getThreadCount()-1
+		// @returns false if the worker is not executing a chunk
+		bool getWorkerChunk(int slot, ChunkInfo& res) const {
+			const ChunkWatch& w = info[slot].watch;
+			// Retry if the worker moved on to another chunk while we were reading
+			for (;;) {
+				res.start = w.start.load(std::memory_order_acquire);
+				if (res.start == 0) return false;
+				res.begin = w.begin.load(std::memory_order_relaxed);
+				res.end = w.end.load(std::memory_order_relaxed);
+				res.region = w.region.load(std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (w.start.load(std::memory_order_relaxed) == res.start) return true;
+			}
+		}
+
+		// Makes the workers measure, for every job index, the wall time against the processor time their thread got
+		// and the involuntary context switches it suffered. Tells scheduler interference - other processes, or the
+		// hypervisor on virtual machines - apart from imbalance in the algorithm. Costs four system calls per index.
+		// Takes effect with the next job a worker starts. Does nothing if the policy has no STATS.
+		void setPreemptionTracking(bool on) { trackPreemption = STATS && on; }
+
+		// Returns the preemption totals of a worker since it was spawned
+		// @param slot The slot of the worker, 0..getThreadCount()-1
+		PreemptionStats getWorkerPreemption(int slot) const {
+			return readPreemption(info[slot].preemption[0]);
+		}
+
+		// Returns the preemption figures of every region the workers executed, summed over the workers
+		// and sorted by the time spent off the processor
+		std::vector<PreemptionStats> getRegionPreemption(void) {
+			MutexRAII lock(poolLock);
+			std::vector<PreemptionStats> res;
+			for (int i = 0; i < threadsInPool; i++) {
+				for (int r = 1; r <= PREEMPTION_REGIONS; r++) {
+					const PreemptionStats s = readPreemption(info[i].preemption[r]);
+					if (!s.region) break;
+					size_t k = 0;
+					while (k < res.size() && res[k].region != s.region && strcmp(res[k].region, s.region) != 0) k++;
+					if (k == res.size()) {
+						res.push_back(s);
+					} else {
+						res[k].jobs += s.jobs;
+						res[k].wallNs += s.wallNs;
+						res[k].cpuNs += s.cpuNs;
+						res[k].involuntarySwitches += s.involuntarySwitches;
+					}
+				}
+			}
+			std::sort(res.begin(), res.end(),
+				[](const PreemptionStats& a, const PreemptionStats& b) { return a.getOffCpuNs() > b.getOffCpuNs(); });
+			return res;
+		}
+
+		// Prints the preemption figures of every worker and region
+		void reportPreemption(FILE* out = stdout) {
+			const int numWorkers = getThreadCount();
+			fprintf(out, "%-24s %10s %12s %12s %12s %8s %10s\n",
+				"worker / region", "jobs", "wall ms", "cpu ms", "off-cpu ms", "off %", "preempted");
+			const auto print = [out](const char* title, const PreemptionStats& s) {
+				fprintf(out, "%-24s %10lld %12.3f %12.3f %12.3f %8.2f %10lld\n", title, (long long)s.jobs, s.wallNs / 1e6,
+					s.cpuNs / 1e6, s.getOffCpuNs() / 1e6, s.wallNs ? 100.0 * s.getOffCpuNs() / s.wallNs : 0.0,
+					(long long)s.involuntarySwitches);
+			};
+			for (int i = 0; i < numWorkers; i++) {
+				const PreemptionStats s = getWorkerPreemption(i);
+				if (s.jobs == 0) continue;
+				char title[32];
+				snprintf(title, sizeof(title), "worker %d", i);
+				print(title, s);
+			}
+			const std::vector<PreemptionStats> regions = getRegionPreemption();
+			for (size_t i = 0; i < regions.size(); i++) {
+				print(regions[i].region, regions[i]);
+			}
+		}
+
+		// Returns how many workers are currently executing jobs
+		int getBusyThreadCount(void) const { return busyWorkers; }
+
+		// Returns the average time it takes to get an extra worker running, in nanoseconds
+		int64 getWakeCost(void) const { return wakeCost; }
 
 		// Run requested number of threads and wait for them to finish.
+		// If other jobs keep the whole pool busy the calling thread executes the indices no worker could take.
 		// @param job The algorithm to run
 		// @param numThreads How many threads to run the algorithm with.
-		void run(MultiThreaded* job, int numThreads) {
-			if (numThreads == 1) {
-				job->threadProc(0, 1);
-				return;
+		// @returns How many threads executed the job at the same time - the workers it got, plus the caller if it helped
+		int run(MultiThreaded* job, int numThreads) {
+			JobContext ctx;
+			startJob(ctx, job, numThreads);
+			joinJob(ctx);
+			finishJob(ctx);
+			return getConcurrency(ctx);
+		}
+
+		// The completion handle of a job started with runAsync. Waits for the job when destroyed.
+		class RunHandle {
+		public:
+			RunHandle() : pool(NULL), throttle(NULL), start(0), work(0) {}
+			RunHandle(RunHandle&& rhs) noexcept
+				: pool(rhs.pool), ctx(std::move(rhs.ctx)), throttle(rhs.throttle), start(rhs.start), work(rhs.work) {
+				rhs.pool = NULL;
 			}
-			// Spawn all threads
-			while (threadsInPool < numThreads) {
-				spawnNewThread();
+			RunHandle& operator=(RunHandle&& rhs) noexcept {
+				if (this != &rhs) {
+					wait();
+					pool = rhs.pool;
+					ctx = std::move(rhs.ctx);
+					throttle = rhs.throttle;
+					start = rhs.start;
+					work = rhs.work;
+					rhs.pool = NULL;
+				}
+				return *this;
 			}
+			~RunHandle() { wait(); }
 
-			counter = numThreads;
-			workComplete = false;
-			// For each thread
-			for (int i = 0; i < numThreads; i++) {
-				info[i].index = i;               // Set its index
-				info[i].numThreads = numThreads; // Set total number of threads
-				info[i].algorithm = job;         // Init the function that is going to be executed
+			// Blocks until the job is done. Does nothing if it already is
+			void wait(void) {
+				if (!pool) return;
+				pool->joinJob(*ctx);
+				finish();
+			}
 
-				// Wait for the thread to enter its main loop before we let it run
-				while (info[i].state != THREAD_IDLE) {
-					wait(20);
+			// Completes the job if it is done, without blocking. Returns whether it is done
+			bool tryWait(void) {
+				if (!pool) return true;
+				if (ctx->workers > 0) {
+					if (ctx->spinning) {
+						if (ctx->counter.load(std::memory_order_acquire) != 0) return false;
+					} else if (!ctx->done.tryWait()) {
+						return false;
+					}
 				}
+				finish();
+				return true;
+			}
 
-				// The thread has entered its main loop, so signal it to begin
-				info[i].state = THREAD_RUNNING;
-				info[i].changedState.signal();
+			// Whether all indices of the job have been executed. Unlike tryWait does not complete the job,
+			// wait() or tryWait() still have to be called before the algorithm is reused
+			bool isDone(void) const {
+				return !pool || ctx->counter.load(std::memory_order_acquire) == 0;
 			}
 
-			// Wait for the last thread to signal and exit the wait loop.
-			//The check is in a loop to guard against spurious wakes.
-			//We check on a flag different from the wait condition as the flag is persistent.
-			//If all worker threads complete the job and signal before the main thread reaches this line
-			//we will enter a deadlock as the main thread will sleep here forever. With the flag
-			//the signalling is not lost
-			while (!workComplete) {
-				waitForThreads.wait();
+		private:
+			ThreadManagerT* pool;             // NULL once the job is complete
+			std::unique_ptr<JobContext> ctx;  // Heap allocated, the workers point to it
+			ConcurrencyThrottle* throttle;    // Reported to once the job is complete. May be NULL
+			int64 start;                      // When the job was started, for the throttle
+			int64 work;                       // Work done by the job, for the throttle
+
+			void finish(void) {
+				pool->finishJob(*ctx);
+				if (throttle) {
+					throttle->report(getConcurrency(*ctx), work, getTimeNs() - start);
+				}
+				pool = NULL;
+				ctx.reset();
 			}
 
-			// round robin all threads until they come to rest
-			while (1) {
-				bool good = true;
-				for (int i = 0; i < numThreads; i++) {
-					if (info[i].state != THREAD_IDLE) {
-						good = false;
-					}
+			friend struct ThreadManagerT;
+			friend struct MultiThreadedFor;
+			RunHandle(const RunHandle&) = delete;
+			RunHandle& operator=(const RunHandle&) = delete;
+		};
+
+		// Starts a job like run(), but returns as soon as the workers are dispatched, so the caller can do other work
+		// while the job executes. If the pool cannot take all indices the caller executes the rest before returning,
+		// just like run() would. The job must stay alive and must not be run again until the handle is complete.
+		RunHandle runAsync(MultiThreaded* job, int numThreads) {
+			RunHandle res;
+			res.ctx.reset(new JobContext);
+			startJob(*res.ctx, job, numThreads);
+			res.pool = this;
+			return res;
+		}
+
+		// Queues a task to run on the pool and returns without waiting for it.
+		// A worker is woken for every task that no already running drainer is free to pick up, up to one per
+		// processor. If the whole pool is kept busy by other jobs and nobody drains the queue, the task runs on the calling
+		// thread before submit returns. Tasks may submit further tasks.
+		// Any callable works. Typical lambdas are stored in the Task without allocating, see TaskT.
+		void submit(Task&& task) {
+			int wake;
+			{
+				MutexRAII lock(taskLock);
+				tasks.push(std::move(task));
+				wake = claimTaskWorkers();
+			}
+			if (wake > 0) {
+				startTaskWorkers(wake);
+			}
+		}
+
+		template <class F>
+		void submit(F&& f) {
+			submit(Task(std::forward<F>(f)));
+		}
+
+		// Queues all tasks of a range with a single lock acquisition and wakes as many workers as the batch needs,
+		// in a single reservation. Much cheaper than submitting the tasks one by one when fanning out many small tasks.
+		// @param first, last The tasks, or callables to wrap in tasks. They are moved from
+		template <class Iterator>
+		void submitBulk(Iterator first, Iterator last) {
+			int wake;
+			{
+				MutexRAII lock(taskLock);
+				reserveTasks(first, last, typename std::iterator_traits<Iterator>::iterator_category());
+				for (; first != last; ++first) {
+					tasks.push(Task(std::move(*first)));
+				}
+				wake = claimTaskWorkers();
+			}
+			if (wake > 0) {
+				startTaskWorkers(wake);
+			}
+		}
+
+		// Runs one queued task on the calling thread, if there is one. Lets a thread that waits for a task's result
+		// help instead of blocking. Returns false if the queue was empty.
+		bool runPendingTask(void) {
+			Task task;
+			{
+				MutexRAII lock(taskLock);
+				if (!tasks.pop(task)) return false;
+				taskHelpers++;
+			}
+			task();
+			task.reset();
+			int wake = 0;
+			{
+				MutexRAII lock(taskLock);
+				taskHelpers--;
+				// Tasks the helped task submitted may have found the drainer limit used up. Make sure someone drains them
+				if (!tasks.empty()) {
+					wake = claimTaskWorkers();
+				} else if (0 == taskWorkers && 0 == taskHelpers) {
+					tasksIdle.notify_all();
 				}
-				if (good) break;
-				wait(20);
+			}
+			if (wake > 0) {
+				startTaskWorkers(wake);
+			}
+			return true;
+		}
+
+		// Returns when all submitted tasks have finished, including tasks submitted by them.
+		// The calling thread executes queued tasks while it waits.
+		void waitForTasks(void) {
+			{
+				MutexRAII lock(taskLock);
+				if (tasks.empty() && taskWorkers == 0 && taskHelpers == 0) return;
+				taskWorkers++;
+			}
+			drainTasks();
+			MutexLock lock(taskLock);
+			while (taskWorkers != 0 || taskHelpers != 0 || !tasks.empty()) {
+				if (taskWorkers == 0 && !tasks.empty()) {
+					// Nobody is left to drain what was queued meanwhile
+					taskWorkers++;
+					lock.unlock();
+					drainTasks();
+					lock.lock();
+					continue;
+				}
+				tasksIdle.wait(lock);
 			}
 		}
 
 		// Stops all threads and frees the resources allocated by them
+		// Must not be called while there are jobs running
 		void killall(void) {
+			MutexRAII lock(poolLock);
 			for (; threadsInPool > 0; threadsInPool--) {
 				ThreadInfoStruct& threadInfo = info[threadsInPool - 1];
-				while (threadInfo.state != THREAD_IDLE) wait(20);
+				while (threadInfo.busy) wait(1);
 				threadInfo.state = THREAD_DONE;
-				threadInfo.changedState.signal();
-				while (threadInfo.state != THREAD_DEAD) wait(20);
-				threadInfo.handle.detach();
+				wake(threadInfo);
+				threadInfo.handle.join();
 			}
 		}
 	};
 
-	inline void MultiThreaded::run(ThreadManager& threadman, int numThreads) {
+	template <class Policy>
+	inline void MultiThreaded::run(ThreadManagerT<Policy>& threadman, int numThreads) {
 		threadman.run(this, numThreads);
 	}
 
+	template <class Policy>
+	inline void MultiThreadedFor::run(ThreadManagerT<Policy>& threadman, int numIterations, int numThreads) {
+		prepare<Policy>(numIterations);
+		if (throttle) {
+			numThreads = throttle->choose(numThreads == THREADS_AUTO ? getProcessorCount() : numThreads);
+			const int64 start = getTimeNs();
+			// A busy pool may give the loop fewer workers than chosen. What is measured is what actually ran
+			const int ran = threadman.run(this, numThreads);
+			throttle->report(ran, numIterations, getTimeNs() - start);
+			return;
+		}
+		if (numThreads == THREADS_AUTO) {
+			numThreads = chooseThreadCount(threadman, getProcessorCount());
+		}
+		MultiThreaded::run(threadman, numThreads);
+	}
+
+	template <class Policy>
+	inline typename ThreadManagerT<Policy>::RunHandle
+	MultiThreadedFor::runAsync(ThreadManagerT<Policy>& threadman, int numIterations, int numThreads) {
+		prepare<Policy>(numIterations);
+		if (throttle) {
+			numThreads = throttle->choose(numThreads == THREADS_AUTO ? getProcessorCount() : numThreads);
+			const int64 start = getTimeNs();
+			typename ThreadManagerT<Policy>::RunHandle res = threadman.runAsync(this, numThreads);
+			res.throttle = throttle;
+			res.start = start;
+			res.work = numIterations;
+			return res;
+		}
+		if (numThreads == THREADS_AUTO) {
+			numThreads = chooseThreadCount(threadman, getProcessorCount());
+		}
+		return threadman.runAsync(this, numThreads);
+	}
+
+	template <class Policy>
+	inline int MultiThreadedFor::chooseThreadCount(ThreadManagerT<Policy>& threadman, int maxThreads) {
+		// Run iterations inline for about the time it would take to wake one worker.
+		// That work is not wasted, and if the loop is that small we never pay for waking anyone.
+		const int64 wakeCost = threadman.getWakeCost();
+		const int64 probeStart = getTimeNs();
+		int64 elapsed = 0;
+		int probed = 0;
+		int i = 0;
+		while (elapsed < wakeCost && (i = idx++) < count) {
+			if (Policy::TRACING) {
+				THREADMAN_TRACE3(chunk_claim, this, i, 0);
+			}
+			body(i, 0, 1);
+			++probed;
+			elapsed = getTimeNs() - probeStart;
+		}
+		if (probed > 0) {
+			const double measured = double(elapsed) / probed;
+			nsPerIteration = (nsPerIteration > 0) ? (nsPerIteration * 3 + measured) / 4 : measured;
+		}
+
+		const int remaining = count - idx;
+		if (remaining <= 0) {
+			return 1;
+		}
+
+		// With n workers the loop takes about work/n + n*wakeCost, which is smallest for n = sqrt(work/wakeCost)
+		const double work = nsPerIteration * remaining;
+		int best = int(sqrt(work / double(wakeCost > 0 ? wakeCost : 1)));
+
+		// Do not count on workers that other jobs are keeping busy
+		const int available = std::min(maxThreads, int(Policy::MAX_WORKERS)) - threadman.getBusyThreadCount();
+		best = std::min(best, std::min(available, remaining));
+		return (best < 2) ? 1 : best;
+	}
+
 }//namespace a7az0th
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cxxabi.h>
+#include <signal.h>
+
+#include "poolstats.h"
+
+using namespace a7az0th;
+
+// Attaches to the statistics a ThreadManager publishes with publishStats() and shows what its workers do,
+// refreshed every interval: state, utilization, jobs per second, job and wake latency percentiles and the region.
+//
+// Usage: threadman-top <pid | segment name> [interval ms] [refreshes]
+// A pid selects the default segment of that process. With refreshes the tool exits after that many screens
+// and does not clear the terminal, so the output can be logged.
+
+static std::string demangle(const char* name) {
+	int status = 0;
+	char* res = abi::__cxa_demangle(name, NULL, NULL, &status);
+	if (status != 0 || !res) return name;
+	std::string str(res);
+	free(res);
+	return str;
+}
+
+// Returns the smallest duration at least the given fraction of the histogram counts fall below, in microseconds.
+// -1 if the histogram is empty.
+static double getPercentileUs(const int64* hist, double fraction) {
+	int64 total = 0;
+	for (int b = 0; b < POOL_STATS_BUCKETS; b++) total += hist[b];
+	if (total == 0) return -1;
+	int64 seen = 0;
+	for (int b = 0; b < POOL_STATS_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= fraction * total) {
+			// The upper bound of the bucket
+			return double(int64(2) << b) / 1000.0;
+		}
+	}
+	return -1;
+}
+
+static void printUs(double us) {
+	if (us < 0) {
+		printf(" %9s", "-");
+	} else {
+		printf(" %9.1f", us);
+	}
+}
+
+static const char* getStateName(int state) {
+	switch (state) {
+	case POOL_WORKER_PARKED: return "parked";
+	case POOL_WORKER_IDLE: return "idle";
+	case POOL_WORKER_RUNNING: return "running";
+	}
+	return "-";
+}
+
+// Busy time including the part of the current job done so far
+static int64 getBusyNs(const PoolWorkerStats& ws, int64 now) {
+	return ws.busyNs + ((ws.state == POOL_WORKER_RUNNING) ? std::max(now - ws.stateSince, int64(0)) : 0);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s <pid | segment name> [interval ms] [refreshes]\n", argv[0]);
+		return 1;
+	}
+	char name[64];
+	if (argv[1][0] >= '0' && argv[1][0] <= '9') {
+		getStatsSegmentName(atoi(argv[1]), name, sizeof(name));
+	} else {
+		snprintf(name, sizeof(name), "%s", argv[1]);
+	}
+	const int intervalMs = std::max((argc > 2) ? atoi(argv[2]) : 1000, 10);
+	const int refreshes = (argc > 3) ? atoi(argv[3]) : 0;
+
+	const PoolStats* stats = openStatsSegment(name);
+	if (!stats) {
+		printf("Could not attach to %s\n", name);
+		return 1;
+	}
+
+	static PoolWorkerStats prev[POOL_STATS_MAX_WORKERS];
+	static PoolWorkerStats cur[POOL_STATS_MAX_WORKERS];
+	int64 prevRuns = stats->runs;
+	int64 prevInline = stats->inlineJobs;
+	int64 prevTime = getTimeNs();
+	for (int i = 0; i < POOL_STATS_MAX_WORKERS; i++) {
+		readWorkerStats(stats->workers[i], prev[i]);
+	}
+
+	for (int screen = 0; refreshes == 0 || screen < refreshes; screen++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+		if (kill(stats->pid, 0) != 0) {
+			printf("Process %d is gone\n", stats->pid);
+			break;
+		}
+		const int64 now = getTimeNs();
+		const double seconds = double(now - prevTime) / 1e9;
+		const int numWorkers = std::min(int(stats->numWorkers), POOL_STATS_MAX_WORKERS);
+		const int64 runs = stats->runs;
+		const int64 inlineJobs = stats->inlineJobs;
+
+		if (refreshes == 0) {
+			printf("\033[H\033[2J");
+		}
+		double totalUtil = 0;
+		for (int i = 0; i < numWorkers; i++) {
+			readWorkerStats(stats->workers[i], cur[i]);
+			totalUtil += double(getBusyNs(cur[i], now) - getBusyNs(prev[i], prevTime)) / double(now - prevTime);
+		}
+		printf("%s  pid %d  workers %d  runs/s %.0f  inline jobs/s %.0f  utilization %.1f%%\n\n", name, stats->pid,
+			numWorkers, (runs - prevRuns) / seconds, (inlineJobs - prevInline) / seconds,
+			numWorkers ? 100.0 * totalUtil / numWorkers : 0.0);
+		printf("%4s %8s %-8s %6s %10s %9s %9s %9s  %s\n",
+			"slot", "tid", "state", "util%", "jobs/s", "p50 us", "p99 us", "wake p99", "region");
+
+		for (int i = 0; i < numWorkers; i++) {
+			const PoolWorkerStats& c = cur[i];
+			const PoolWorkerStats& p = prev[i];
+			int64 jobHist[POOL_STATS_BUCKETS];
+			int64 wakeHist[POOL_STATS_BUCKETS];
+			for (int b = 0; b < POOL_STATS_BUCKETS; b++) {
+				jobHist[b] = c.jobHistogram[b] - p.jobHistogram[b];
+				wakeHist[b] = c.wakeHistogram[b] - p.wakeHistogram[b];
+			}
+			const double util = double(getBusyNs(c, now) - getBusyNs(p, prevTime)) / double(now - prevTime);
+			printf("%4d %8d %-8s %6.1f %10.0f", i, c.tid, getStateName(c.state), 100.0 * std::min(util, 1.0),
+				(c.jobs - p.jobs) / seconds);
+			printUs(getPercentileUs(jobHist, 0.5));
+			printUs(getPercentileUs(jobHist, 0.99));
+			printUs(getPercentileUs(wakeHist, 0.99));
+			printf("  %s\n", c.region[0] ? demangle(c.region).c_str() : "-");
+			memcpy((void*)&prev[i], (const void*)&c, sizeof(c));
+		}
+		fflush(stdout);
+		prevRuns = runs;
+		prevInline = inlineJobs;
+		prevTime = now;
+	}
+	closeStatsSegment(stats, NULL);
+	return 0;
+}
@@ -1,11 +1,17 @@
 #pragma once
 
 #include <chrono>
+#include <assert.h>
 
 namespace a7az0th {
 
 typedef long long int int64 ;
 
+// Returns the current value of a monotonic clock in nanoseconds. Only differences between two values are meaningful.
+inline int64 getTimeNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 class Timer {
 public:
 	enum Precision {
@@ -18,7 +24,7 @@ public:
 	~Timer() {};
 
 	void start() { init(); }
-	void stop() { endPoint = std::chrono::system_clock::now(); }
+	void stop() { endPoint = std::chrono::steady_clock::now(); }
 
 	// Returns the elapsed time in the precision specified
 	int64 elapsed(Precision prec) {
@@ -47,14 +53,14 @@ public:
 
 private:
 	void init() {
-		startPoint = endPoint = std::chrono::system_clock::now();
+		startPoint = endPoint = std::chrono::steady_clock::now();
 	}
 	// Disallow evil contructors
 	Timer(const Timer&) = delete;
 	Timer& operator=(const Timer&) = delete;
 
-	std::chrono::system_clock::time_point startPoint;
-	std::chrono::system_clock::time_point endPoint;
+	std::chrono::steady_clock::time_point startPoint;
+	std::chrono::steady_clock::time_point endPoint;
 };
 
 }
@@ -0,0 +1,61 @@
+#pragma once
+
+// Static user-level tracepoints (USDT) for live tracing of the pool with bpftrace, perf or SystemTap.
+// A probe compiles to a nop plus a note in the binary, guarded by a semaphore so that its arguments are only
+// evaluated while a tracer is attached. THREADMAN_TRACE_ENABLED(name) tells whether one is.
+// They are built in whenever <sys/sdt.h> is available (package systemtap-sdt-dev or systemtap-sdt-devel).
+// Define THREADMAN_NO_TRACEPOINTS to leave them out.
+//
+// All probes are in the provider "threadman":
+//   run_start(job, region, numThreads)   ThreadManager::run was entered
+//   run_end(job, numThreads, workers)    ThreadManager::run is about to return. workers is how many pool threads took part
+//   dispatch(job, slot, index)           The caller released a worker to run index of the job
+//   worker_wake(job, slot, index)        A worker woke up and starts executing its index
+//   worker_done(job, slot, index)        A worker finished its index
+//   inline_exec(job, index, numThreads)  The caller executes an index itself because the pool was exhausted
+//   chunk_claim(job, iteration, threadIdx) A thread of a MultiThreadedFor claimed an iteration
+//   join(job, workers, wakeNs)           The caller finished waiting for the workers of the job. wakeNs is the time from
+//                                        the first dispatch until the last worker started
+// job is the address of the MultiThreaded object and region its name, as returned by getName().
+//
+// Example: bpftrace -e 'usdt:./thrman:threadman:join { @wake_us = hist(arg2 / 1000); }'
+
+#if !defined(THREADMAN_NO_TRACEPOINTS) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+// Included by someone else first, the probes were built without semaphores and are always evaluated
+#ifdef _SYS_SDT_H
+#define THREADMAN_TRACE_ENABLED(name) 1
+#else
+#define _SDT_HAS_SEMAPHORES 1
+#endif
+#include <sys/sdt.h>
+#define THREADMAN_HAS_TRACEPOINTS 1
+#endif
+#endif
+
+#ifdef THREADMAN_HAS_TRACEPOINTS
+#ifndef THREADMAN_TRACE_ENABLED
+// A tracer increments the semaphore of a probe while it is attached. The arguments (the region name is a typeid
+// lookup) are only evaluated then, so a detached probe costs a load and a branch.
+// Weak, so that every translation unit including the header shares one semaphore per probe.
+#define THREADMAN_TRACE_SEMAPHORE(name) \
+	__attribute__((weak, section(".probes"))) volatile unsigned short threadman_##name##_semaphore = 0;
+THREADMAN_TRACE_SEMAPHORE(run_start)
+THREADMAN_TRACE_SEMAPHORE(run_end)
+THREADMAN_TRACE_SEMAPHORE(dispatch)
+THREADMAN_TRACE_SEMAPHORE(worker_wake)
+THREADMAN_TRACE_SEMAPHORE(worker_done)
+THREADMAN_TRACE_SEMAPHORE(inline_exec)
+THREADMAN_TRACE_SEMAPHORE(chunk_claim)
+THREADMAN_TRACE_SEMAPHORE(join)
+#define THREADMAN_TRACE_ENABLED(name) __builtin_expect(threadman_##name##_semaphore != 0, 0)
+#endif
+#define THREADMAN_TRACE3(name, a, b, c) \
+	do { if (THREADMAN_TRACE_ENABLED(name)) { DTRACE_PROBE3(threadman, name, a, b, c); } } while (0)
+#else
+#define THREADMAN_TRACE_ENABLED(name) 0
+#define THREADMAN_TRACE3(name, a, b, c)
+#endif
+
+// The probes of ThreadManagerT. Compiled out if its Policy has no TRACING
+#define THREADMAN_POOL_TRACE3(name, a, b, c) do { if (Policy::TRACING) { THREADMAN_TRACE3(name, a, b, c); } } while (0)
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+#include "threadman.h"
+#include "timer.h"
+
+namespace a7az0th {
+
+	// A chunk that ran longer than the threshold of a StallDetector
+	struct StallReport {
+		int slot;           // Slot of the worker executing the chunk
+		int tid;            // OS id of the worker
+		const char* region; // Name of the region, see MultiThreaded::setName
+		int begin, end;     // Iterations [begin, end) of the chunk. -1 if the chunk is a whole index of the job
+		int64 elapsedNs;    // How long the chunk has been running when it was reported
+		bool finished;      // False when the stall is detected, true when the chunk that stalled has completed
+	};
+
+	// A watchdog that flags chunks running for longer than a threshold - a single pathological iteration of a
+	// MultiThreadedFor holds up the whole region, and this tells which iteration and which worker it was.
+	// A background thread looks at the chunk start times the workers publish (see ThreadManager::addChunkWatcher)
+	// every quarter of the threshold, so a stall is reported between 1 and 1.25 thresholds after the chunk started.
+	// Each stalled chunk is reported once when it is detected and once more when it finishes, with its total time.
+	// Only chunks executed by pool workers are watched, indices run on the calling thread are not.
+	class StallDetector {
+	public:
+		typedef std::function<void(const StallReport&)> Callback;
+
+		// @param threadman The pool to watch
+		// @param thresholdMs Chunks running longer than that are reported
+		// @param callback Called from the watchdog thread for every report. Empty to print to stderr
+		template <class Policy>
+		StallDetector(ThreadManagerT<Policy>& threadman, int thresholdMs, Callback callback = Callback())
+			: threadman(Pool::make(threadman)), thresholdNs(int64(thresholdMs) * 1000000), callback(callback), stopping(false) {
+			if (!this->callback) {
+				this->callback = &printReport;
+			}
+			threadman.addChunkWatcher();
+			thread = std::thread(&StallDetector::watch, this);
+		}
+
+		~StallDetector() {
+			{
+				std::unique_lock<std::mutex> lk(m);
+				stopping = true;
+			}
+			c.notify_one();
+			thread.join();
+			threadman.removeChunkWatcher(threadman.pool);
+		}
+
+		// Prints a report to stderr. The default callback
+		static void printReport(const StallReport& r) {
+			char range[48] = "whole index";
+			if (r.begin >= 0) {
+				snprintf(range, sizeof(range), "iterations [%d, %d)", r.begin, r.end);
+			}
+			fprintf(stderr, "threadman: %s chunk in %s, %s, worker %d (tid %d): %.1f ms\n",
+				r.finished ? "stalled" : "stalling", r.region ? r.region : "?", range, r.slot, r.tid, r.elapsedNs / 1e6);
+		}
+
+	private:
+		// The watched pool with its policy erased, like FutureExecutor
+		struct Pool {
+			void* pool;
+			int (*getThreadCount)(void* pool);
+			bool (*getWorkerChunk)(void* pool, int slot, ChunkInfo& res);
+			int (*getWorkerTid)(void* pool, int slot);
+			void (*removeChunkWatcher)(void* pool);
+
+			template <class Policy>
+			static Pool make(ThreadManagerT<Policy>& threadman) {
+				Pool res = { &threadman, &threadCountOf<Policy>, &workerChunkOf<Policy>, &workerTidOf<Policy>, &removeWatcherOf<Policy> };
+				return res;
+			}
+
+		private:
+			template <class Policy>
+			static int threadCountOf(void* pool) { return static_cast<ThreadManagerT<Policy>*>(pool)->getThreadCount(); }
+			template <class Policy>
+			static bool workerChunkOf(void* pool, int slot, ChunkInfo& res) { return static_cast<ThreadManagerT<Policy>*>(pool)->getWorkerChunk(slot, res); }
+			template <class Policy>
+			static int workerTidOf(void* pool, int slot) { return static_cast<ThreadManagerT<Policy>*>(pool)->getWorkerTid(slot); }
+			template <class Policy>
+			static void removeWatcherOf(void* pool) { static_cast<ThreadManagerT<Policy>*>(pool)->removeChunkWatcher(); }
+		};
+
+		Pool threadman;
+		int64 thresholdNs;
+		Callback callback;
+		std::thread thread;
+		std::mutex m;
+		std::condition_variable c;
+		bool stopping; // Set by the destructor. Guarded by m
+
+		void watch(void) {
+			// The chunk last reported for every worker, to report it only once and to notice when it finishes
+			std::vector<ChunkInfo> reported(MAX_CPU_COUNT);
+			for (int i = 0; i < MAX_CPU_COUNT; i++) {
+				reported[i].start = 0;
+			}
+			const int64 periodNs = std::max(thresholdNs / 4, int64(1000000));
+			std::unique_lock<std::mutex> lk(m);
+			while (!stopping) {
+				c.wait_for(lk, std::chrono::nanoseconds(periodNs));
+				const int numWorkers = threadman.getThreadCount(threadman.pool);
+				const int64 now = getTimeNs();
+				for (int slot = 0; slot < numWorkers; slot++) {
+					ChunkInfo chunk;
+					const bool running = threadman.getWorkerChunk(threadman.pool, slot, chunk);
+					ChunkInfo& last = reported[slot];
+					if (last.start != 0 && (!running || chunk.start != last.start)) {
+						// The stalled chunk is done. The time it took is only known to within the polling period
+						report(slot, last, now - last.start, true);
+						last.start = 0;
+					}
+					if (running && chunk.start != last.start && now - chunk.start >= thresholdNs) {
+						report(slot, chunk, now - chunk.start, false);
+						last = chunk;
+					}
+				}
+			}
+		}
+
+		void report(int slot, const ChunkInfo& chunk, int64 elapsed, bool finished) {
+			StallReport r;
+			r.slot = slot;
+			r.tid = threadman.getWorkerTid(threadman.pool, slot);
+			r.region = chunk.region;
+			r.begin = chunk.begin;
+			r.end = chunk.end;
+			r.elapsedNs = elapsed;
+			r.finished = finished;
+			callback(r);
+		}
+
+		StallDetector(const StallDetector&) = delete;
+		StallDetector& operator=(const StallDetector&) = delete;
+	};
+
+}//namespace a7az0th
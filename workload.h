@@ -0,0 +1,259 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <random>
+#include <thread>
+#include <algorithm>
+
+#include "threadman.h"
+#include "timer.h"
+
+namespace a7az0th {
+
+	// What a work item does with its cost
+	enum WorkKind {
+		WORK_COMPUTE = 0, // Burns the processor. The amount is in nanoseconds of single-threaded compute
+		WORK_MEMORY,      // Streams through a buffer bigger than the caches. The amount is in bytes
+		WORK_SLEEP,       // Blocks without using the processor. The amount is in nanoseconds
+	};
+
+	// How the costs of the work items are distributed
+	enum CostDistribution {
+		COST_UNIFORM = 0, // Evenly spread between half and one and a half times the mean
+		COST_HEAVY_TAILED,// Pareto distributed. Most items are cheap, a few are extremely expensive
+		COST_BIMODAL,     // Two kinds of items - cheap ones and a fraction of expensive ones
+	};
+
+	// A single iteration of a synthetic loop
+	struct WorkItem {
+		WorkKind kind;
+		int64 amount; // Nanoseconds or bytes, depending on the kind
+	};
+
+	// Describes a synthetic workload
+	struct WorkloadParams {
+		CostDistribution distribution;
+		WorkKind kind;
+		int64 mean;             // Mean cost of an item, in nanoseconds or bytes
+		double tailIndex;       // Pareto shape for COST_HEAVY_TAILED. Smaller means a heavier tail, must be > 1
+		double heavyFraction;   // Fraction of expensive items for COST_BIMODAL
+		double heavyRatio;      // How many times an expensive item costs more than a cheap one, for COST_BIMODAL
+		unsigned seed;          // Seed for the random generator, so runs are repeatable
+
+		WorkloadParams()
+			: distribution(COST_UNIFORM), kind(WORK_COMPUTE), mean(1000), tailIndex(1.5)
+			, heavyFraction(0.05), heavyRatio(100), seed(1) {}
+	};
+
+	// A list of work items, generated from a distribution or replayed from a recorded trace
+	class Workload {
+	public:
+		// Creates count items with costs drawn from the given distribution
+		static Workload generate(const WorkloadParams& params, int count) {
+			Workload res;
+			std::mt19937 rng(params.seed);
+			std::uniform_real_distribution<double> unit(0.0, 1.0);
+			const double mean = double(params.mean);
+			const double alpha = std::max(1.01, params.tailIndex);
+			// Scale of the Pareto distribution that gives the requested mean
+			const double paretoScale = mean * (alpha - 1) / alpha;
+			// Cost of a cheap item in the bimodal distribution that gives the requested mean
+			const double cheap = mean / (1 - params.heavyFraction + params.heavyFraction * params.heavyRatio);
+
+			res.items.resize(count);
+			for (int i = 0; i < count; i++) {
+				const double u = unit(rng);
+				double cost = mean;
+				switch (params.distribution) {
+				case COST_UNIFORM:
+					cost = mean * (0.5 + u);
+					break;
+				case COST_HEAVY_TAILED:
+					// Cap the tail so a single item cannot take forever
+					cost = std::min(paretoScale / pow(1 - u, 1 / alpha), mean * 10000);
+					break;
+				case COST_BIMODAL:
+					cost = (u < params.heavyFraction) ? cheap * params.heavyRatio : cheap;
+					break;
+				}
+				res.items[i].kind = params.kind;
+				res.items[i].amount = int64(cost);
+			}
+			return res;
+		}
+
+		// Loads a trace. Each line holds the cost of one item followed by its kind (compute, memory or sleep).
+		// The kind may be omitted, in which case it is compute. Lines starting with # are ignored.
+		// Returns false if the file could not be read.
+		static bool loadTrace(const char* path, Workload& res) {
+			FILE* f = fopen(path, "r");
+			if (!f) {
+				return false;
+			}
+			res.items.clear();
+			char line[256];
+			while (fgets(line, sizeof(line), f)) {
+				long long amount = 0;
+				char kind[32] = "compute";
+				if (line[0] == '#' || sscanf(line, "%lld %31s", &amount, kind) < 1) {
+					continue;
+				}
+				WorkItem item;
+				item.amount = amount;
+				item.kind = WORK_COMPUTE;
+				if (0 == strcmp(kind, "memory")) item.kind = WORK_MEMORY;
+				if (0 == strcmp(kind, "sleep")) item.kind = WORK_SLEEP;
+				res.items.push_back(item);
+			}
+			fclose(f);
+			return true;
+		}
+
+		// Writes the items in the format loadTrace reads. Returns false on failure.
+		bool saveTrace(const char* path) const {
+			FILE* f = fopen(path, "w");
+			if (!f) {
+				return false;
+			}
+			static const char* kinds[] = { "compute", "memory", "sleep" };
+			fprintf(f, "# cost kind\n");
+			for (size_t i = 0; i < items.size(); i++) {
+				fprintf(f, "%lld %s\n", items[i].amount, kinds[items[i].kind]);
+			}
+			return 0 == fclose(f);
+		}
+
+		int size(void) const { return int(items.size()); }
+		const WorkItem& operator[](int i) const { return items[i]; }
+		void add(const WorkItem& item) { items.push_back(item); }
+
+		// Returns the sum of the costs of all items of the given kind
+		int64 getTotal(WorkKind kind) const {
+			int64 total = 0;
+			for (size_t i = 0; i < items.size(); i++) {
+				if (items[i].kind == kind) total += items[i].amount;
+			}
+			return total;
+		}
+
+	private:
+		std::vector<WorkItem> items;
+	};
+
+	// Executes work items. Compute work is a fixed amount of arithmetic calibrated to the requested time, so an item
+	// that gets preempted takes longer instead of finishing early.
+	class WorkExecutor {
+	public:
+		// @param memoryBytes Size of the buffer memory items stream through. Should be well above the last level cache
+		explicit WorkExecutor(size_t memoryBytes = 256 << 20) : buffer(memoryBytes / sizeof(int64), 1) {
+			calibrate();
+		}
+
+		// Does the work of a single item. Different threads may call it at the same time.
+		// @param offset Where to start streaming for memory items, to spread threads over the buffer
+		int64 execute(const WorkItem& item, size_t offset = 0) const {
+			switch (item.kind) {
+			case WORK_COMPUTE:
+				return spin(int64(double(item.amount) * loopsPerNs));
+			case WORK_MEMORY: {
+				int64 sum = 0;
+				const size_t count = size_t(item.amount) / sizeof(int64);
+				size_t i = offset % buffer.size();
+				for (size_t k = 0; k < count; k++) {
+					sum += buffer[i];
+					if (++i == buffer.size()) i = 0;
+				}
+				return sum;
+			}
+			case WORK_SLEEP:
+				std::this_thread::sleep_for(std::chrono::nanoseconds(item.amount));
+				return 0;
+			}
+			return 0;
+		}
+
+	private:
+		std::vector<int64> buffer; // Streamed through by memory items
+		double loopsPerNs;         // Calibrated speed of spin()
+
+		static int64 spin(int64 loops) {
+			// A dependent chain, so the compiler cannot fold it and the processor cannot overlap it
+			volatile int64 seed = 1;
+			int64 x = seed;
+			for (int64 i = 0; i < loops; i++) {
+				x = x * 6364136223846793005LL + 1442695040888963407LL;
+			}
+			return x;
+		}
+
+		void calibrate(void) {
+			const int64 loops = 1 << 22;
+			int64 best = 0;
+			// Take the fastest of a few tries, the others were probably interrupted
+			for (int i = 0; i < 3; i++) {
+				const int64 start = getTimeNs();
+				spin(loops);
+				const int64 elapsed = getTimeNs() - start;
+				if (best == 0 || elapsed < best) best = elapsed;
+			}
+			loopsPerNs = double(loops) / double(std::max(best, int64(1)));
+		}
+	};
+
+	// Runs a workload through MultiThreadedFor, one item per iteration
+	struct WorkloadFor : MultiThreadedFor {
+		WorkloadFor(const Workload& workload, const WorkExecutor& executor) : workload(workload), executor(executor), sink(0) {}
+
+		template <class Policy>
+		void run(ThreadManagerT<Policy>& threadman, int numThreads) {
+			MultiThreadedFor::run(threadman, workload.size(), numThreads);
+		}
+
+		void body(int index, int threadIdx, int) override {
+			sink += executor.execute(workload[index], size_t(threadIdx) << 20);
+		}
+
+	private:
+		const Workload& workload;
+		const WorkExecutor& executor;
+		std::atomic<int64> sink; // Keeps the work from being optimized away
+	};
+
+	// Wraps a real loop and records how long each of its iterations takes, so that the costs can be saved
+	// as a trace and replayed later through WorkloadFor with different scheduling settings.
+	struct TraceRecordingFor : MultiThreadedFor {
+		explicit TraceRecordingFor(MultiThreadedFor& loop) : loop(loop) {}
+
+		template <class Policy>
+		void run(ThreadManagerT<Policy>& threadman, int numIterations, int numThreads) {
+			costs.assign(numIterations, 0);
+			MultiThreadedFor::run(threadman, numIterations, numThreads);
+		}
+
+		void body(int index, int threadIdx, int numThreads) override {
+			const int64 start = getTimeNs();
+			loop.body(index, threadIdx, numThreads);
+			costs[index] = getTimeNs() - start;
+		}
+
+		// Returns the recorded costs as compute items
+		Workload getTrace(void) const {
+			Workload res;
+			for (size_t i = 0; i < costs.size(); i++) {
+				WorkItem item;
+				item.kind = WORK_COMPUTE;
+				item.amount = costs[i];
+				res.add(item);
+			}
+			return res;
+		}
+
+	private:
+		MultiThreadedFor& loop;
+		std::vector<int64> costs; // Wall time of every iteration of the last run
+	};
+
+}//namespace a7az0th
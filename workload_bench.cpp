@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "threadman.h"
+#include "algorithms.h"
+#include "workload.h"
+#include "timer.h"
+
+using namespace a7az0th;
+
+// Runs synthetic workloads with different cost distributions, or a recorded trace, through the scheduling
+// options ThreadManager offers, on a default and on a low-latency pool, and prints how long each took.
+//
+// Usage: workload_bench [numThreads] [trace file]
+// The trace format is described in Workload::loadTrace.
+
+// Executes a contiguous, statically assigned part of the workload on every thread
+struct StaticWorkload : MultiThreaded {
+	StaticWorkload(const Workload& workload, const WorkExecutor& executor) : workload(workload), executor(executor), sink(0) {}
+	void threadProc(int index, int numThreads) override {
+		int begin, end;
+		getRange(index, numThreads, workload.size(), begin, end);
+		int64 sum = 0;
+		for (int i = begin; i < end; i++) {
+			sum += executor.execute(workload[i], size_t(index) << 20);
+		}
+		sink += sum;
+	}
+private:
+	const Workload& workload;
+	const WorkExecutor& executor;
+	std::atomic<int64> sink;
+};
+
+static double measureMs(Timer& timer) {
+	return double(timer.elapsed(Timer::Nanoseconds)) / 1e6;
+}
+
+template <class Policy>
+static void runPolicies(const char* name, const Workload& workload, const WorkExecutor& executor,
+	ThreadManagerT<Policy>& threadman, int numThreads) {
+	const int64 compute = workload.getTotal(WORK_COMPUTE) + workload.getTotal(WORK_SLEEP);
+	// The best possible time if the items were perfectly spread over the threads
+	const double idealMs = double(compute) / numThreads / 1e6;
+
+	printf("%-26s", name);
+
+	Timer timer;
+	StaticWorkload staticLoop(workload, executor);
+	staticLoop.run(threadman, numThreads);
+	timer.stop();
+	printf(" %10.2f", measureMs(timer));
+
+	timer.start();
+	WorkloadFor dynamicLoop(workload, executor);
+	dynamicLoop.run(threadman, numThreads);
+	timer.stop();
+	printf(" %10.2f", measureMs(timer));
+
+	timer.start();
+	WorkloadFor autoLoop(workload, executor);
+	autoLoop.run(threadman, THREADS_AUTO);
+	timer.stop();
+	printf(" %10.2f", measureMs(timer));
+
+	timer.start();
+	const WorkItem* first = &workload[0];
+	a7az0th::for_each(execution::par(threadman, numThreads), first, first + workload.size(),
+		[&executor](const WorkItem& item) { executor.execute(item); });
+	timer.stop();
+	printf(" %10.2f", measureMs(timer));
+
+	if (idealMs > 0) {
+		printf(" %10.2f", idealMs);
+	} else {
+		printf(" %10s", "-");
+	}
+	printf("\n");
+}
+
+// Runs the workload on both pools, the low-latency one in the row below
+static void runPools(const char* name, const Workload& workload, const WorkExecutor& executor,
+	ThreadManager& threadman, LowLatencyThreadManager& lowLatency, int numThreads) {
+	runPolicies(name, workload, executor, threadman, numThreads);
+	runPolicies("  low-latency pool", workload, executor, lowLatency, numThreads);
+}
+
+int main(int argc, char* argv[]) {
+	const int numThreads = std::max(1, std::min((argc > 1) ? atoi(argv[1]) : getProcessorCount(), MAX_CPU_COUNT));
+	const char* tracePath = (argc > 2) ? argv[2] : NULL;
+
+	ThreadManager threadman;
+	threadman.warmup(numThreads);
+	LowLatencyThreadManager lowLatency;
+	lowLatency.warmup(numThreads);
+	WorkExecutor executor;
+
+	printf("%d threads, times in ms\n", numThreads);
+	printf("%-26s %10s %10s %10s %10s %10s\n", "workload", "static", "dynamic", "auto", "chunked", "ideal");
+
+	if (tracePath) {
+		Workload trace;
+		if (!Workload::loadTrace(tracePath, trace) || trace.size() == 0) {
+			printf("Could not read trace %s\n", tracePath);
+			return 1;
+		}
+		runPools(tracePath, trace, executor, threadman, lowLatency, numThreads);
+		return 0;
+	}
+
+	const int count = 20000;
+	WorkloadParams params;
+	params.mean = 2000;
+
+	params.distribution = COST_UNIFORM;
+	runPools("uniform compute", Workload::generate(params, count), executor, threadman, lowLatency, numThreads);
+
+	params.distribution = COST_HEAVY_TAILED;
+	runPools("heavy-tailed compute", Workload::generate(params, count), executor, threadman, lowLatency, numThreads);
+
+	params.distribution = COST_BIMODAL;
+	runPools("bimodal compute", Workload::generate(params, count), executor, threadman, lowLatency, numThreads);
+
+	params.distribution = COST_UNIFORM;
+	params.kind = WORK_MEMORY;
+	params.mean = 64 << 10;
+	runPools("uniform memory-bound", Workload::generate(params, count / 4), executor, threadman, lowLatency, numThreads);
+
+	params.distribution = COST_BIMODAL;
+	params.kind = WORK_SLEEP;
+	params.mean = 20000;
+	runPools("bimodal blocking", Workload::generate(params, count / 20), executor, threadman, lowLatency, numThreads);
+	return 0;
+}